@@ -1,3 +1,3 @@
 #!/usr/bin/env bash
 
-g++ -O2 --std=c++11 -Wall -o main src/main.cpp
+g++ -O2 --std=c++11 -Wall -pthread -o main src/main.cpp
@@ -1,3 +1,9 @@
 #!/usr/bin/env bash
 
-qlmanage -p test.ppm >/dev/null 2>/dev/null
\ No newline at end of file
+# For a live view while rendering, use ./main --preview and open
+# http://localhost:8080/ instead.
+if command -v qlmanage >/dev/null; then
+  qlmanage -p test.ppm >/dev/null 2>/dev/null
+else
+  xdg-open test.ppm >/dev/null 2>/dev/null
+fi
@@ -0,0 +1,182 @@
+namespace bench {
+
+// NOTE(johan): Micro-benchmarks for the math in the inner loops. Each one runs
+// over a fixed set of precomputed inputs a few times and keeps the fastest
+// run, reported in nanoseconds per call. Where there's a plain version of the
+// same thing (a divide, sqrt and divide, libm pow) it's timed next to it. The
+// vec3 layout itself is a compile time switch, so to see what SSE buys build
+// once with USE_SIMD set to 0 and compare the two runs.
+
+const u32 inputCount = 4096;
+const u32 repeats = 200;
+const u32 runs = 5;
+
+volatile f32 sink;
+
+template <typename Fn>
+f32 measure(Fn fn) {
+  f32 best = FLT_MAX;
+  for (u32 run = 0; run < runs; run++) {
+    auto start = std::chrono::steady_clock::now();
+    f32 total = 0;
+    for (u32 repeat = 0; repeat < repeats; repeat++) {
+      for (u32 i = 0; i < inputCount; i++) {
+        total += fn(i);
+      }
+    }
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    sink = total;
+
+    f32 nanoseconds =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    best = min(best, nanoseconds / (inputCount * repeats));
+  }
+  return best;
+}
+
+void report(const char* name, f32 nanoseconds) {
+  printf("%-22s %7.2f ns\n", name, nanoseconds);
+}
+
+void report(const char* name, f32 nanoseconds, f32 reference) {
+  printf("%-22s %7.2f ns  (plain %7.2f ns, %.2fx)\n", name, nanoseconds,
+         reference, reference / nanoseconds);
+}
+
+// The sphere test as it was before the inverse radius and fast normalize
+bool findHitReference(const entity::Sphere& sphere,
+                      const camera::Ray& ray,
+                      const f32 tMin,
+                      const f32 tMax,
+                      Hit& hit) {
+  vec3 oc = ray.origin - sphere.center;
+  f32 a = dot(ray.direction, ray.direction);
+  f32 b = dot(oc, ray.direction);
+  f32 c = dot(oc, oc) - sphere.radius * sphere.radius;
+  f32 discriminant = b * b - a * c;
+
+  if (discriminant > 0) {
+    f32 t = (-b - sqrt(discriminant)) / a;
+    if (t < tMax && t > tMin) {
+      hit.t = t;
+      hit.p = rayAt(ray, t);
+      vec3 n = (hit.p - sphere.center) / sphere.radius;
+      hit.normal = n / n.length();
+
+      f32 phi = atan2(hit.normal.z, hit.normal.x);
+      f32 theta = asin(max(min(hit.normal.y, 1), -1));
+      hit.u = 1 - (phi + M_PI) / (2 * M_PI);
+      hit.v = (theta + M_PI / 2) / M_PI;
+      hit.uvScale = 1 / (M_PI * sphere.radius);
+      return true;
+    }
+  }
+  return false;
+}
+
+void run() {
+  seedRandom(1);
+
+  std::vector<vec3> vectors(inputCount);
+  std::vector<f32> scalars(inputCount);
+  std::vector<camera::Ray> rays(inputCount);
+  for (u32 i = 0; i < inputCount; i++) {
+    vectors[i] = 2 * vec3(randomUnit(), randomUnit(), randomUnit()) -
+                 vec3(1, 1, 1) + vec3(0.01f, 0, 0);
+    scalars[i] = 0.01f + randomUnit();
+
+    // Rays from a shell around the sphere towards a point near its center,
+    // so about half of them hit
+    vec3 origin = 4 * normalize(vectors[i]);
+    vec3 target = 1.5f * randomPointInUnitSphere();
+    rays[i] = {origin, normalize(target - origin)};
+  }
+
+  entity::Entity* sphereEntity =
+      entity::createSphere(vec3(0, 0, 0), 1, nullptr);
+  const entity::Sphere& sphere = sphereEntity->sphere;
+
+  std::cout << "Math (" << (USE_SIMD ? "SSE" : "scalar") << " vec3, "
+            << sizeof(vec3) << " bytes)\n";
+
+  report("normalize", measure([&](u32 i) {
+           return normalize(vectors[i]).x;
+         }),
+         measure([&](u32 i) {
+           const vec3& v = vectors[i];
+           return (v / v.length()).x;
+         }));
+
+  report("reciprocal", measure([&](u32 i) {
+           return reciprocal(scalars[i]);
+         }),
+         measure([&](u32 i) { return 1 / scalars[i]; }));
+
+  report("rsqrt", measure([&](u32 i) {
+           return rsqrt(scalars[i]);
+         }),
+         measure([&](u32 i) { return 1 / sqrt(scalars[i]); }));
+
+  report("pow 5", measure([&](u32 i) {
+           return powi(scalars[i], 5);
+         }),
+         measure([&](u32 i) { return f32(pow(scalars[i], 5)); }));
+
+  report("dot", measure([&](u32 i) {
+           return dot(vectors[i], vectors[(i + 1) % inputCount]);
+         }));
+
+  report("cross", measure([&](u32 i) {
+           return cross(vectors[i], vectors[(i + 1) % inputCount]).y;
+         }));
+
+  report("sphere hit", measure([&](u32 i) {
+           Hit hit;
+           return entity::findHit(sphere, rays[i], 0.001f, FLT_MAX, hit)
+                      ? hit.normal.y
+                      : 0;
+         }),
+         measure([&](u32 i) {
+           Hit hit;
+           return findHitReference(sphere, rays[i], 0.001f, FLT_MAX, hit)
+                      ? hit.normal.y
+                      : 0;
+         }));
+
+  // Scatter off hits on the sphere, one material type at a time
+  std::vector<Hit> hits;
+  std::vector<camera::Ray> hitRays;
+  for (u32 i = 0; hits.size() < inputCount; i = (i + 1) % inputCount) {
+    Hit hit;
+    if (entity::findHit(sphere, rays[i], 0.001f, FLT_MAX, hit)) {
+      hit.coneWidth = 0;
+      hits.push_back(hit);
+      hitRays.push_back(rays[i]);
+    }
+  }
+
+  struct {
+    const char* name;
+    material::Material* material;
+  } materials[] = {
+      {"scatter diffuse", material::createDiffuse(vec3(0.5, 0.5, 0.5))},
+      {"scatter metal", material::createMetal(vec3(0.5, 0.5, 0.5), 0.3)},
+      {"scatter dielectric", material::createDielectric(1.5)},
+  };
+
+  std::cout << "\nScatter\n";
+  for (auto& entry : materials) {
+    report(entry.name, measure([&](u32 i) {
+             vec3 attenuation;
+             camera::Ray scattered;
+             Hit& hit = hits[i];
+             hit.material = entry.material;
+             return material::scatter(entry.material, hitRays[i], hit,
+                                      attenuation, scattered)
+                        ? scattered.direction.x
+                        : 0;
+           }));
+  }
+}
+
+}  // namespace bench
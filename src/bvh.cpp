@@ -36,6 +36,7 @@ AABB surroundingBox(const AABB& box0, const AABB& box1) {
   return createAABB(minPoint, maxPoint);
 }
 
+template <bool SpheresOnly = false>
 bool findHit(const BoundingVolume* volume,
              const camera::Ray& ray,
              f32 tMin,
@@ -48,9 +49,11 @@ bool findHit(const BoundingVolume* volume,
     bool hitRight = false;
 
     if (volume->left)
-      hitLeft = findHit(volume->left, ray, tMin, tMax, leftHit, depth + 1);
+      hitLeft = findHit<SpheresOnly>(volume->left, ray, tMin, tMax, leftHit,
+                                     depth + 1);
     if (volume->right)
-      hitRight = findHit(volume->right, ray, tMin, tMax, rightHit, depth + 1);
+      hitRight = findHit<SpheresOnly>(volume->right, ray, tMin, tMax,
+                                      rightHit, depth + 1);
 
     if (hitLeft && hitRight) {
       hit = leftHit.t < rightHit.t ? leftHit : rightHit;
@@ -65,7 +68,7 @@ bool findHit(const BoundingVolume* volume,
       return true;
 
     } else {
-      return findHit(volume->entities, ray, tMin, tMax, hit);
+      return ::findHit<SpheresOnly>(volume->entities, ray, tMin, tMax, hit);
     }
   } else {
     return false;
@@ -127,4 +130,595 @@ BoundingVolume::BoundingVolume(EntityList& _entities, u32 depth = 0) {
   }
 }
 
-};  // namespace bvh
\ No newline at end of file
+//
+// Spatial split BVH
+//
+
+// NOTE(johan): Builds the same BoundingVolume tree with the surface area
+// heuristic, and with spatial splits as in Stich et al. "Spatial Splits in
+// Bounding Volume Hierarchies". When the best partition of the entities
+// leaves two children that overlap a lot, usually because of a few big
+// entities, it can be cheaper to split space instead. An entity straddling
+// the plane is then referenced from both sides, with its box clipped to each.
+// Traversal doesn't change, a leaf still tests whole entities and the closest
+// hit wins whichever node found it.
+struct Reference {
+  entity::Entity* entity;
+  AABB box;
+};
+
+const u32 splitBinCount = 32;
+const u32 maxSplitLeafSize = 4;
+const u32 maxSplitDepth = 64;
+const f32 traversalCost = 1;
+const f32 intersectionCost = 1;
+
+// Spatial splits are only tried when the children of the best object split
+// overlap by more than this fraction of the root's surface area
+const f32 spatialSplitOverlap = 1e-5f;
+
+inline AABB emptyBox() {
+  return createAABB(vec3(FLT_MAX, FLT_MAX, FLT_MAX),
+                    vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX));
+}
+
+inline bool isEmpty(const AABB& box) {
+  return box.minPoint.x > box.maxPoint.x || box.minPoint.y > box.maxPoint.y ||
+         box.minPoint.z > box.maxPoint.z;
+}
+
+inline f32 surfaceArea(const AABB& box) {
+  if (isEmpty(box))
+    return 0;
+  vec3 size = box.maxPoint - box.minPoint;
+  return 2 * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
+
+inline AABB intersection(const AABB& box0, const AABB& box1) {
+  vec3 minPoint(max(box0.minPoint.x, box1.minPoint.x),
+                max(box0.minPoint.y, box1.minPoint.y),
+                max(box0.minPoint.z, box1.minPoint.z));
+  vec3 maxPoint(min(box0.maxPoint.x, box1.maxPoint.x),
+                min(box0.maxPoint.y, box1.maxPoint.y),
+                min(box0.maxPoint.z, box1.maxPoint.z));
+  return createAABB(minPoint, maxPoint);
+}
+
+inline f32 centroid(const AABB& box, u32 axis) {
+  return 0.5f * (box.minPoint[axis] + box.maxPoint[axis]);
+}
+
+struct Split {
+  f32 cost;
+  u32 axis;
+  f32 position;
+  bool spatial;
+  AABB leftBox;
+  AABB rightBox;
+};
+
+// Binned SAH over reference centroids
+void findObjectSplit(const std::vector<Reference>& references,
+                     Split& best) {
+  AABB centroids = emptyBox();
+  for (auto& reference : references) {
+    vec3 center = 0.5f * (reference.box.minPoint + reference.box.maxPoint);
+    centroids = surroundingBox(centroids, createAABB(center, center));
+  }
+
+  for (u32 axis = 0; axis < 3; axis++) {
+    f32 origin = centroids.minPoint[axis];
+    f32 extent = centroids.maxPoint[axis] - origin;
+    if (extent <= 0)
+      continue;
+
+    AABB boxes[splitBinCount];
+    u32 counts[splitBinCount] = {};
+    for (u32 i = 0; i < splitBinCount; i++) {
+      boxes[i] = emptyBox();
+    }
+    for (auto& reference : references) {
+      f32 offset = (centroid(reference.box, axis) - origin) / extent;
+      u32 bin = std::min<u32>(offset * splitBinCount, splitBinCount - 1);
+      boxes[bin] = surroundingBox(boxes[bin], reference.box);
+      counts[bin]++;
+    }
+
+    // Sweep from the right to get the right side of every plane, then from
+    // the left to cost them
+    AABB rightBoxes[splitBinCount];
+    u32 rightCounts[splitBinCount];
+    AABB box = emptyBox();
+    u32 count = 0;
+    for (u32 i = splitBinCount - 1; i > 0; i--) {
+      box = surroundingBox(box, boxes[i]);
+      count += counts[i];
+      rightBoxes[i] = box;
+      rightCounts[i] = count;
+    }
+
+    box = emptyBox();
+    count = 0;
+    for (u32 i = 1; i < splitBinCount; i++) {
+      box = surroundingBox(box, boxes[i - 1]);
+      count += counts[i - 1];
+      if (!count || !rightCounts[i])
+        continue;
+
+      f32 cost = surfaceArea(box) * count +
+                 surfaceArea(rightBoxes[i]) * rightCounts[i];
+      if (cost < best.cost) {
+        best.cost = cost;
+        best.axis = axis;
+        best.position = origin + extent * i / splitBinCount;
+        best.spatial = false;
+        best.leftBox = box;
+        best.rightBox = rightBoxes[i];
+      }
+    }
+  }
+}
+
+// Clips a reference to one side of a plane, false if nothing is left
+inline bool clipReference(const Reference& reference,
+                          u32 axis,
+                          f32 low,
+                          f32 high,
+                          Reference& clipped) {
+  AABB clip = reference.box;
+  clip.minPoint[axis] = max(clip.minPoint[axis], low);
+  clip.maxPoint[axis] = min(clip.maxPoint[axis], high);
+  clipped.entity = reference.entity;
+  return entity::getClippedBoundingBox(reference.entity, clip, clipped.box);
+}
+
+// Binned spatial splits, each reference is clipped into every bin it spans
+void findSpatialSplit(const std::vector<Reference>& references,
+                      const AABB& nodeBox,
+                      Split& best) {
+  for (u32 axis = 0; axis < 3; axis++) {
+    f32 origin = nodeBox.minPoint[axis];
+    f32 extent = nodeBox.maxPoint[axis] - origin;
+    if (extent <= 0)
+      continue;
+    f32 binSize = extent / splitBinCount;
+
+    AABB boxes[splitBinCount];
+    u32 entries[splitBinCount] = {};
+    u32 exits[splitBinCount] = {};
+    for (u32 i = 0; i < splitBinCount; i++) {
+      boxes[i] = emptyBox();
+    }
+
+    for (auto& reference : references) {
+      f32 first = (reference.box.minPoint[axis] - origin) / binSize;
+      f32 last = (reference.box.maxPoint[axis] - origin) / binSize;
+      u32 firstBin = std::min<u32>(max(first, 0), splitBinCount - 1);
+      u32 lastBin = std::min<u32>(max(last, 0), splitBinCount - 1);
+      for (u32 bin = firstBin; bin <= lastBin; bin++) {
+        Reference clipped;
+        if (clipReference(reference, axis, origin + bin * binSize,
+                          origin + (bin + 1) * binSize, clipped)) {
+          boxes[bin] = surroundingBox(boxes[bin], clipped.box);
+        }
+      }
+      entries[firstBin]++;
+      exits[lastBin]++;
+    }
+
+    AABB rightBoxes[splitBinCount];
+    u32 rightCounts[splitBinCount];
+    AABB box = emptyBox();
+    u32 count = 0;
+    for (u32 i = splitBinCount - 1; i > 0; i--) {
+      box = surroundingBox(box, boxes[i]);
+      count += exits[i];
+      rightBoxes[i] = box;
+      rightCounts[i] = count;
+    }
+
+    box = emptyBox();
+    count = 0;
+    for (u32 i = 1; i < splitBinCount; i++) {
+      box = surroundingBox(box, boxes[i - 1]);
+      count += entries[i - 1];
+      if (!count || !rightCounts[i])
+        continue;
+
+      f32 cost = surfaceArea(box) * count +
+                 surfaceArea(rightBoxes[i]) * rightCounts[i];
+      if (cost < best.cost) {
+        best.cost = cost;
+        best.axis = axis;
+        best.position = origin + i * binSize;
+        best.spatial = true;
+        best.leftBox = box;
+        best.rightBox = rightBoxes[i];
+      }
+    }
+  }
+}
+
+void partition(const std::vector<Reference>& references,
+               const Split& split,
+               std::vector<Reference>& left,
+               std::vector<Reference>& right) {
+  for (auto& reference : references) {
+    if (!split.spatial) {
+      if (centroid(reference.box, split.axis) < split.position) {
+        left.push_back(reference);
+      } else {
+        right.push_back(reference);
+      }
+    } else if (reference.box.maxPoint[split.axis] <= split.position) {
+      left.push_back(reference);
+    } else if (reference.box.minPoint[split.axis] >= split.position) {
+      right.push_back(reference);
+    } else {
+      Reference clipped;
+      if (clipReference(reference, split.axis, -FLT_MAX, split.position,
+                        clipped)) {
+        left.push_back(clipped);
+      }
+      if (clipReference(reference, split.axis, split.position, FLT_MAX,
+                        clipped)) {
+        right.push_back(clipped);
+      }
+    }
+  }
+}
+
+BoundingVolume* buildSpatial(std::vector<Reference>& references,
+                             f32 rootArea,
+                             u32 depth) {
+  BoundingVolume* volume = new BoundingVolume();
+  volume->box = emptyBox();
+  for (auto& reference : references) {
+    volume->box = surroundingBox(volume->box, reference.box);
+  }
+
+  u32 count = references.size();
+  f32 area = surfaceArea(volume->box);
+  f32 leafCost = intersectionCost * count;
+
+  Split best;
+  best.cost = FLT_MAX;
+  if (count > 1 && depth < maxSplitDepth) {
+    findObjectSplit(references, best);
+
+    // Only worth binning space if the object split children overlap
+    if (best.cost < FLT_MAX &&
+        surfaceArea(intersection(best.leftBox, best.rightBox)) >
+            spatialSplitOverlap * rootArea) {
+      findSpatialSplit(references, volume->box, best);
+    }
+  }
+
+  f32 splitCost = best.cost < FLT_MAX
+                      ? traversalCost + intersectionCost * best.cost / area
+                      : FLT_MAX;
+
+  std::vector<Reference> left, right;
+  if (splitCost < FLT_MAX &&
+      (splitCost < leafCost || count > maxSplitLeafSize)) {
+    partition(references, best, left, right);
+  }
+
+  // Spatial splits can fail to separate anything once the clipped boxes are
+  // tiny, fall back to halving along the longest axis
+  if ((left.empty() || right.empty() || left.size() == count ||
+       right.size() == count) &&
+      count > maxSplitLeafSize && depth < maxSplitDepth) {
+    vec3 size = volume->box.maxPoint - volume->box.minPoint;
+    u32 axis = size.x > size.y ? (size.x > size.z ? 0 : 2)
+                               : (size.y > size.z ? 1 : 2);
+    std::sort(references.begin(), references.end(),
+              [axis](const Reference& a, const Reference& b) {
+                return centroid(a.box, axis) < centroid(b.box, axis);
+              });
+    left.assign(references.begin(), references.begin() + count / 2);
+    right.assign(references.begin() + count / 2, references.end());
+  }
+
+  if (left.empty() || right.empty()) {
+    for (auto& reference : references) {
+      volume->entities.push_back(reference.entity);
+    }
+    return volume;
+  }
+
+  // The parent's references aren't needed while the children build
+  std::vector<Reference>().swap(references);
+  volume->left = buildSpatial(left, rootArea, depth + 1);
+  volume->right = buildSpatial(right, rootArea, depth + 1);
+  return volume;
+}
+
+BoundingVolume* createSpatialBvh(const EntityList& entities) {
+  std::vector<Reference> references;
+  references.reserve(entities.size());
+  for (auto entity : entities) {
+    Reference reference = {entity};
+    if (!entity::getBoundingBox(entity, reference.box)) {
+      fatal("Spatial split BVH needs bounded entities");
+    }
+    references.push_back(reference);
+  }
+
+  if (references.empty())
+    return new BoundingVolume();
+
+  AABB box = emptyBox();
+  for (auto& reference : references) {
+    box = surroundingBox(box, reference.box);
+  }
+  return buildSpatial(references, surfaceArea(box), 0);
+}
+
+//
+// Compact BVH
+//
+
+// NOTE(johan): The step between quantized values on each axis of a parent box.
+// It's nudged up a little so the top code always lands on or past the
+// parent's max, whatever the rounding.
+template <typename Q>
+inline vec3 quantizationStep(const AABB& parent) {
+  const f32 scale = (1 + 1e-6f) / std::numeric_limits<Q>::max();
+  return (parent.maxPoint - parent.minPoint) * scale;
+}
+
+template <typename Q>
+inline AABB decodeBox(const CompactNode<Q>& node,
+                      const vec3& origin,
+                      const vec3& step) {
+  AABB box;
+  for (u32 axis = 0; axis < 3; axis++) {
+    box.minPoint[axis] = origin[axis] + node.boundsMin[axis] * step[axis];
+    box.maxPoint[axis] = origin[axis] + node.boundsMax[axis] * step[axis];
+  }
+  return box;
+}
+
+template <typename Q>
+inline AABB decodeBox(const CompactNode<Q>& node, const AABB& parent) {
+  return decodeBox(node, parent.minPoint, quantizationStep<Q>(parent));
+}
+
+// Quantizes box relative to parent, rounding outwards. The result is checked
+// against decodeBox() itself, so float rounding can't make a node smaller than
+// what it contains.
+template <typename Q>
+void encodeBox(const AABB& box, const AABB& parent, CompactNode<Q>& node) {
+  const f32 levels = std::numeric_limits<Q>::max();
+  for (u32 axis = 0; axis < 3; axis++) {
+    f32 origin = parent.minPoint[axis];
+    f32 extent = parent.maxPoint[axis] - origin;
+    if (extent <= 0) {
+      node.boundsMin[axis] = 0;
+      node.boundsMax[axis] = Q(levels);
+      continue;
+    }
+    f32 low = floor((box.minPoint[axis] - origin) / extent * levels);
+    f32 high = ceil((box.maxPoint[axis] - origin) / extent * levels);
+    node.boundsMin[axis] = Q(max(0, min(low, levels)));
+    node.boundsMax[axis] = Q(max(0, min(high, levels)));
+  }
+
+  AABB decoded = decodeBox(node, parent);
+  for (u32 axis = 0; axis < 3; axis++) {
+    while (node.boundsMin[axis] > 0 &&
+           decoded.minPoint[axis] > box.minPoint[axis]) {
+      node.boundsMin[axis]--;
+      decoded = decodeBox(node, parent);
+    }
+    while (node.boundsMax[axis] < levels &&
+           decoded.maxPoint[axis] < box.maxPoint[axis]) {
+      node.boundsMax[axis]++;
+      decoded = decodeBox(node, parent);
+    }
+  }
+}
+
+u32 countEntities(const BoundingVolume* volume) {
+  if (!volume)
+    return 0;
+  return volume->entities.size() + countEntities(volume->left) +
+         countEntities(volume->right);
+}
+
+void collectEntities(const BoundingVolume* volume, EntityList& entities) {
+  if (!volume)
+    return;
+  entities.insert(entities.end(), volume->entities.begin(),
+                  volume->entities.end());
+  collectEntities(volume->left, entities);
+  collectEntities(volume->right, entities);
+}
+
+// NOTE(johan): Subtrees this small are collapsed into a single leaf, testing
+// a few spheres is cheaper than decoding and testing their boxes.
+const u32 maxCompactLeafSize = 4;
+
+template <typename Q>
+void flatten(const BoundingVolume* volume,
+             u32 nodeIndex,
+             const AABB& parent,
+             CompactBvh<Q>* bvh) {
+  encodeBox(volume->box, parent, bvh->nodes[nodeIndex]);
+  AABB box = decodeBox(bvh->nodes[nodeIndex], parent);
+
+  u32 entityCount = countEntities(volume);
+  if (entityCount > maxCompactLeafSize) {
+    if (!volume->left || !volume->right) {
+      fatal("Compact BVH needs two children per interior node");
+    }
+
+    u32 firstChild = bvh->nodes.size();
+    bvh->nodes.resize(firstChild + 2);
+    bvh->nodes[nodeIndex].index = firstChild;
+    bvh->nodes[nodeIndex].count = 0;
+
+    flatten(volume->left, firstChild, box, bvh);
+    flatten(volume->right, firstChild + 1, box, bvh);
+  } else {
+    EntityList entities;
+    collectEntities(volume, entities);
+
+    bvh->nodes[nodeIndex].index = bvh->spheres.size();
+    bvh->nodes[nodeIndex].count = entities.size();
+    for (auto entity : entities) {
+      if (entity->type != entity::EntityType::Sphere) {
+        fatal("Compact BVH only supports spheres");
+      }
+      const entity::Sphere& sphere = entity->sphere;
+      bvh->spheres.push_back({sphere.center.x, sphere.center.y,
+                              sphere.center.z, sphere.radius,
+                              entity->material->id});
+    }
+  }
+}
+
+template <typename Q>
+CompactBvh<Q>* createCompactBvh(const BoundingVolume* root) {
+  CompactBvh<Q>* bvh = new CompactBvh<Q>();
+  if (root->left || root->right || root->entities.size()) {
+    bvh->nodes.resize(1);
+    flatten(root, 0, root->box, bvh);
+    // NOTE(johan): The root's children were encoded against its decoded box,
+    // which is a touch bigger than its real one, so traversal has to start
+    // from exactly that box or every level below decodes slightly off
+    bvh->box = decodeBox(bvh->nodes[0], root->box);
+  }
+  bvh->nodes.shrink_to_fit();
+  bvh->spheres.shrink_to_fit();
+  return bvh;
+}
+
+// Slab test against a decoded box, giving the entry distance for ordering
+inline bool findHit(const AABB& box,
+                    const camera::Ray& ray,
+                    const vec3& inverseDirection,
+                    f32 tMin,
+                    f32 tMax,
+                    f32& tEntry) {
+  for (u32 axis = 0; axis < 3; axis++) {
+    f32 t0 = (box.minPoint[axis] - ray.origin[axis]) * inverseDirection[axis];
+    f32 t1 = (box.maxPoint[axis] - ray.origin[axis]) * inverseDirection[axis];
+    tMin = max(min(t0, t1), tMin);
+    tMax = min(max(t0, t1), tMax);
+    if (tMax < tMin)
+      return false;
+  }
+  tEntry = tMin;
+  return true;
+}
+
+// Closest hit, traversed front to back with an explicit stack so the search
+// distance shrinks as soon as anything is hit. The compact BVH only ever
+// holds spheres, so SpheresOnly makes no difference here.
+template <bool SpheresOnly = false, typename Q>
+bool findHit(const CompactBvhView<Q>& bvh,
+             const camera::Ray& ray,
+             f32 tMin,
+             f32 tMax,
+             Hit& hit) {
+  struct StackEntry {
+    u32 node;
+    AABB box;
+  };
+
+  if (!bvh.nodeCount)
+    return false;
+
+  vec3 inverseDirection(1 / ray.direction.x, 1 / ray.direction.y,
+                        1 / ray.direction.z);
+
+  const u32 maxStackDepth = 128;
+  StackEntry stack[maxStackDepth];
+  u32 stackSize = 0;
+
+  f32 tEntry;
+  if (findHit(bvh.box, ray, inverseDirection, tMin, tMax, tEntry)) {
+    stack[stackSize++] = {0, bvh.box};
+  }
+
+  f32 tClosest = tMax;
+  u32 closestMaterial = 0;
+  bool hasHit = false;
+
+  while (stackSize) {
+    StackEntry entry = stack[--stackSize];
+    const CompactNode<Q>& node = bvh.nodes[entry.node];
+
+    if (node.count) {
+      for (u32 i = node.index; i < node.index + node.count; i++) {
+        const CompactSphere& compact = bvh.spheres[i];
+        entity::Sphere sphere = {vec3(compact.x, compact.y, compact.z),
+                                 compact.radius, 1 / compact.radius};
+        if (entity::findHit(sphere, ray, tMin, tClosest, hit)) {
+          hasHit = true;
+          tClosest = hit.t;
+          closestMaterial = compact.materialId;
+        }
+      }
+      continue;
+    }
+
+    // NOTE(johan): The nearer child is pushed last so it's visited first
+    vec3 step = quantizationStep<Q>(entry.box);
+    AABB boxes[2];
+    f32 tEntries[2];
+    bool hits[2];
+    for (u32 i = 0; i < 2; i++) {
+      boxes[i] =
+          decodeBox(bvh.nodes[node.index + i], entry.box.minPoint, step);
+      hits[i] =
+          findHit(boxes[i], ray, inverseDirection, tMin, tClosest, tEntries[i]);
+    }
+
+    u32 first = (hits[0] && hits[1] && tEntries[1] < tEntries[0]) ? 1 : 0;
+    for (u32 i = 0; i < 2; i++) {
+      u32 child = i == 0 ? 1 - first : first;
+      if (hits[child]) {
+        if (stackSize == maxStackDepth) {
+          fatal("Compact BVH stack overflow");
+        }
+        stack[stackSize++] = {node.index + child, boxes[child]};
+      }
+    }
+  }
+
+  if (hasHit) {
+    hit.material = material::materials[closestMaterial];
+  }
+  return hasHit;
+}
+
+template <bool SpheresOnly = false, typename Q>
+bool findHit(const CompactBvh<Q>* bvh,
+             const camera::Ray& ray,
+             f32 tMin,
+             f32 tMax,
+             Hit& hit) {
+  CompactBvhView<Q> view = {bvh->box, bvh->nodes.data(),
+                            u32(bvh->nodes.size()), bvh->spheres.data()};
+  return findHit<SpheresOnly>(view, ray, tMin, tMax, hit);
+}
+
+u64 memoryUsage(const BoundingVolume* volume) {
+  if (!volume)
+    return 0;
+  return sizeof(BoundingVolume) +
+         volume->entities.capacity() * sizeof(entity::Entity*) +
+         volume->entities.size() * sizeof(entity::Entity) +
+         memoryUsage(volume->left) + memoryUsage(volume->right);
+}
+
+template <typename Q>
+u64 memoryUsage(const CompactBvh<Q>* bvh) {
+  return sizeof(CompactBvh<Q>) + bvh->nodes.size() * sizeof(CompactNode<Q>) +
+         bvh->spheres.size() * sizeof(CompactSphere);
+}
+
+};  // namespace bvh
@@ -10,9 +10,46 @@ struct BoundingVolume {
   BoundingVolume* right;
   EntityList entities;
 
+  BoundingVolume() : left(nullptr), right(nullptr) {}
   BoundingVolume(EntityList& _entities, u32 depth);
 };
 
+// NOTE(johan): The compact BVH is a flattened copy of the BoundingVolume
+// tree for big scenes. Each node's box is quantized to Q (u8 or u16) relative
+// to its parent's box, rounded outwards so it's always conservative. Children
+// are stored next to each other and found by index, and leaves point at a run
+// of spheres that refer to their material by id instead of by pointer.
+template <typename Q>
+struct CompactNode {
+  Q boundsMin[3];
+  Q boundsMax[3];
+  u32 index;  // First child for interior nodes, first sphere for leaves
+  u32 count;  // Number of spheres in a leaf, zero for interior nodes
+};
+
+struct CompactSphere {
+  f32 x, y, z;
+  f32 radius;
+  u32 materialId;
+};
+
+template <typename Q>
+struct CompactBvh {
+  AABB box;  // The root as decoded, what its children are relative to
+  std::vector<CompactNode<Q>> nodes;
+  std::vector<CompactSphere> spheres;
+};
+
+// A compact BVH wherever its arrays happen to be, such as a chunk mapped from
+// disk (see paging.h)
+template <typename Q>
+struct CompactBvhView {
+  AABB box;
+  const CompactNode<Q>* nodes;
+  u32 nodeCount;
+  const CompactSphere* spheres;
+};
+
 AABB createAABB(const vec3& minPoint, const vec3& maxPoint);
 AABB surroundingBox(const AABB& box0, const AABB& box1);
 
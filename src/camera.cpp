@@ -27,13 +27,66 @@ Camera* createCamera(const vec3 origin,
   camera->vertical = 2 * halfHeight * focusDistance * camera->up;
 
   camera->lensRadius = aperture / 2;
+  camera->pixelSpread = 2 * halfHeight / height;
+
+  camera->lookAt = lookAt;
+  camera->worldUp = worldUp;
+  camera->width = width;
+  camera->height = height;
+  camera->vFov = vFov;
+  camera->aperture = aperture;
+  camera->focusDistance = focusDistance;
 
   return camera;
 }
 
+// Moves the camera around its look at point, yaw about the world up and
+// pitch towards it (both in degrees), and scales its distance by dolly. The
+// focus distance scales along with it so the same plane stays sharp.
+Camera* orbit(const Camera* camera, f32 yaw, f32 pitch, f32 dolly) {
+  vec3 offset = camera->origin - camera->lookAt;
+  f32 distance = offset.length();
+  vec3 up = normalize(camera->worldUp);
+  vec3 side = normalize(cross(up, offset));
+  vec3 back = cross(side, up);
+
+  f32 height = dot(offset, up) / distance;
+  f32 elevation = asin(max(-1, min(height, 1))) + pitch * M_PI / 180;
+  f32 limit = 89 * M_PI / 180;
+  elevation = max(-limit, min(elevation, limit));
+  f32 azimuth = yaw * M_PI / 180;
+
+  distance *= dolly;
+  vec3 horizontal = cos(azimuth) * back + sin(azimuth) * side;
+  vec3 origin = camera->lookAt +
+                distance * (cos(elevation) * horizontal + sin(elevation) * up);
+
+  return createCamera(origin, camera->lookAt, camera->worldUp, camera->width,
+                      camera->height, camera->vFov, camera->aperture,
+                      camera->focusDistance * dolly);
+}
+
+// Moves the camera and its look at point distance towards its left, so it
+// keeps looking the same way. Negative distances move it right.
+Camera* slide(const Camera* camera, f32 distance) {
+  vec3 offset = distance * camera->left;
+  return createCamera(camera->origin + offset, camera->lookAt + offset,
+                      camera->worldUp, camera->width, camera->height,
+                      camera->vFov, camera->aperture, camera->focusDistance);
+}
+
+// The same camera for a different image size
+Camera* resize(const Camera* camera, u32 width, u32 height) {
+  return createCamera(camera->origin, camera->lookAt, camera->worldUp, width,
+                      height, camera->vFov, camera->aperture,
+                      camera->focusDistance);
+}
+
+// Without DepthOfField the lens is treated as a pinhole and never sampled
+template <bool DepthOfField>
 Ray ray(Camera* camera, const f32 s, const f32 t) {
   vec3 offset = vec3(0, 0, 0);
-  if (camera->lensRadius) {
+  if (DepthOfField) {
     vec3 lensPoint = camera->lensRadius * randomPointInUnitDisk();
     offset = camera->left * lensPoint.x + camera->up * lensPoint.y;
   }
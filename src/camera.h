@@ -6,9 +6,19 @@ struct Camera {
   vec3 horizontal;
   vec3 vertical;
   f32 lensRadius;
+  f32 pixelSpread;  // Angle subtended by one pixel, for texture filtering
   vec3 forward;
   vec3 left;
   vec3 up;
+
+  // What the camera was created from, so it can be rebuilt after moving
+  vec3 lookAt;
+  vec3 worldUp;
+  u32 width;
+  u32 height;
+  f32 vFov;
+  f32 aperture;
+  f32 focusDistance;
 };
 
 struct Ray {
@@ -0,0 +1,197 @@
+namespace converge {
+
+// NOTE(johan): Measures how fast each scene's image converges, rather than
+// how fast rays go. Every scene is rendered once at a very high sample count
+// as a reference, and then again from scratch doubling the samples each step,
+// comparing against the reference after every step. The references are kept
+// in the output directory, and only re-rendered if missing or made with
+// different settings. Everything goes to convergence.csv there, to plot error
+// against time or samples.
+//
+// Error is measured on the linear colors, as RMSE and as relMSE, which
+// divides each pixel's squared error by its squared reference value so the
+// bright parts don't drown out everything else. Efficiency is
+// 1 / (relMSE * seconds), so a change that halves the error at the same
+// speed or halves the time at the same error doubles it.
+
+const u32 width = 160;
+const u32 height = 90;
+const u32 referenceSamples = 4096;
+
+// The reference's passes are seeded well away from those of the renders being
+// measured, so none of its samples are the same as theirs
+const u32 referencePassOffset = 1 << 24;
+
+// Keeps relMSE finite where the reference is black
+const f64 relativeEpsilon = 1e-2;
+
+struct ReferenceHeader {
+  u32 width;
+  u32 height;
+  u32 samples;
+  u32 maxDepth;
+};
+
+struct Error {
+  f64 rmse;
+  f64 relMse;
+};
+
+bool readReference(const std::string& path,
+                   const ReferenceHeader& expected,
+                   std::vector<vec3>& colors) {
+  std::ifstream file(path, std::ios_base::binary);
+  ReferenceHeader header;
+  if (!file.read((char*)&header, sizeof(header)) ||
+      memcmp(&header, &expected, sizeof(header))) {
+    return false;
+  }
+
+  colors.resize(header.width * header.height);
+  for (auto& color : colors) {
+    f32 rgb[3];
+    file.read((char*)rgb, sizeof(rgb));
+    color = vec3(rgb[0], rgb[1], rgb[2]);
+  }
+  return bool(file);
+}
+
+void writeReference(const std::string& path,
+                    const ReferenceHeader& header,
+                    const std::vector<vec3>& colors) {
+  std::ofstream file(path, std::ios_base::binary);
+  file.write((const char*)&header, sizeof(header));
+  for (auto& color : colors) {
+    f32 rgb[3] = {color.x, color.y, color.z};
+    file.write((const char*)rgb, sizeof(rgb));
+  }
+  if (!file) {
+    fatal("Failed to write a reference image");
+  }
+}
+
+// The framebuffer's average colors
+std::vector<vec3> meanColors(const render::Framebuffer& framebuffer) {
+  f32 scale = 1.0f / framebuffer.samples;
+  std::vector<vec3> colors(framebuffer.color.size());
+  for (u32 i = 0; i < colors.size(); i++) {
+    colors[i] = framebuffer.color[i] * scale;
+  }
+  return colors;
+}
+
+Error measureError(const render::Framebuffer& framebuffer,
+                   const std::vector<vec3>& reference) {
+  f32 scale = 1.0f / framebuffer.samples;
+  f64 squared = 0;
+  f64 relative = 0;
+  for (u32 i = 0; i < reference.size(); i++) {
+    vec3 color = framebuffer.color[i] * scale;
+    for (u32 channel = 0; channel < 3; channel++) {
+      f64 expected = reference[i][channel];
+      f64 difference = color[channel] - expected;
+      squared += difference * difference;
+      relative +=
+          difference * difference / (expected * expected + relativeEpsilon);
+    }
+  }
+  u32 count = reference.size() * 3;
+  return {sqrt(squared / count), relative / count};
+}
+
+f64 secondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<f64>(std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+// Loads the reference for a scene, rendering and saving it if there isn't
+// one for these settings yet
+std::vector<vec3> findReference(const render::RowRenderer& renderRow,
+                                const std::string& directory,
+                                const std::string& name,
+                                const render::RenderSettings& settings) {
+  ReferenceHeader header = {width, height, referenceSamples,
+                            settings.maxDepth};
+  std::string path = directory + "/" + name + ".reference";
+  std::vector<vec3> reference;
+  if (readReference(path, header, reference))
+    return reference;
+
+  std::cerr << name << ": rendering " << referenceSamples
+            << " sample reference" << std::endl;
+  auto start = std::chrono::steady_clock::now();
+  render::Framebuffer* framebuffer = render::createFramebuffer(width, height);
+  framebuffer->passes = referencePassOffset;
+  while (framebuffer->samples < referenceSamples) {
+    u32 passSize = std::min(64u, referenceSamples - framebuffer->samples);
+    render::renderPass(renderRow, *framebuffer, passSize,
+                       settings.threadCount);
+  }
+  std::cerr << name << ": reference took " << secondsSince(start) << "s\n";
+
+  reference = meanColors(*framebuffer);
+  writeReference(path, header, reference);
+  render::writePpm(*framebuffer, directory + "/" + name + ".reference.ppm");
+  delete framebuffer;
+  return reference;
+}
+
+// Renders every scene at up to settings.samples samples per pixel, writing
+// the curves to convergence.csv in directory, or convergence-guided.csv with
+// path guiding. The references are never guided, so both share them.
+void run(const std::string& directory,
+         scenes::AcceleratorType acceleratorType,
+         const render::RenderSettings& settings,
+         bool guided) {
+  mkdir(directory.c_str(), 0755);
+  std::ofstream csv(directory +
+                    (guided ? "/convergence-guided.csv" : "/convergence.csv"));
+  csv << "scene,samples,seconds,rmse,relmse,efficiency\n";
+
+  printf("%-12s %8s %9s %10s %10s %12s\n", "scene", "samples", "seconds",
+         "rmse", "relmse", "efficiency");
+
+  for (auto& demo : scenes::demos) {
+    scenes::LoadedScene* scene = scenes::load(demo.name, acceleratorType);
+    camera::Camera* camera = camera::resize(scene->camera, width, height);
+    render::RowRenderer renderRow =
+        scenes::createRowRenderer(scene, camera, settings.maxDepth);
+
+    std::vector<vec3> reference =
+        findReference(renderRow, directory, demo.name, settings);
+
+    guide::Guide* guide = nullptr;
+    if (guided) {
+      guide = guide::createGuide(scene->bounds, camera);
+      renderRow =
+          scenes::createRowRenderer(scene, camera, settings.maxDepth, guide);
+    }
+
+    // NOTE(johan): Time only counts rendering, not measuring the error
+    render::Framebuffer* framebuffer = render::createFramebuffer(width, height);
+    f64 seconds = 0;
+    for (u32 target = 1; framebuffer->samples < settings.samples;
+         target *= 2) {
+      target = std::min(target, settings.samples);
+      auto start = std::chrono::steady_clock::now();
+      render::renderPass(renderRow, *framebuffer,
+                         target - framebuffer->samples, settings.threadCount);
+      if (guide) {
+        guide::endPass(guide, framebuffer->samples, settings.samples);
+      }
+      seconds += secondsSince(start);
+
+      Error error = measureError(*framebuffer, reference);
+      f64 efficiency = 1 / (error.relMse * seconds);
+      csv << demo.name << "," << framebuffer->samples << "," << seconds << ","
+          << error.rmse << "," << error.relMse << "," << efficiency << "\n";
+      printf("%-12s %8u %9.3f %10.6f %10.6f %12.1f\n", demo.name,
+             framebuffer->samples, seconds, error.rmse, error.relMse,
+             efficiency);
+    }
+    delete framebuffer;
+    free(camera);
+  }
+}
+
+}  // namespace converge
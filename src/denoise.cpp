@@ -0,0 +1,156 @@
+namespace denoise {
+
+Settings defaultSettings() {
+  Settings settings;
+  settings.iterations = 5;
+  settings.colorPhi = 4;
+  settings.normalPhi = 64;
+  settings.depthPhi = 0.02f;
+  return settings;
+}
+
+// Runs body(y) for every row, with rows handed out to threadCount threads
+template <typename Body>
+void forEachRow(u32 height, u32 threadCount, const Body& body) {
+  std::atomic<u32> nextRow(0);
+  auto worker = [&]() {
+    for (u32 y = nextRow++; y < height; y = nextRow++) {
+      body(y);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (u32 i = 1; i < threadCount; i++) {
+    threads.push_back(std::thread(worker));
+  }
+  worker();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+// NOTE(johan): Denoises the framebuffer with the edge-avoiding a-trous
+// wavelet filter (Dammertz et al. 2010), with the luminance edge stopping
+// scaled by a per-pixel noise estimate as in SVGF (Schied et al. 2017). The
+// filter runs on irradiance, i.e. color with the first hit albedo divided out,
+// so texture detail survives and is multiplied back in at the end. Normals
+// and depth from the first hit stop the filter at geometric edges.
+//
+// Returns the averaged, linear, denoised color for every pixel.
+std::vector<vec3> denoise(const render::Framebuffer& framebuffer,
+                          const Settings& settings,
+                          u32 threadCount) {
+  u32 width = framebuffer.width;
+  u32 height = framebuffer.height;
+  u32 pixelCount = width * height;
+  f32 scale = framebuffer.samples ? 1.0f / framebuffer.samples : 0;
+
+  std::vector<vec3> albedos(pixelCount);
+  std::vector<vec3> normals(pixelCount);
+  std::vector<f32> depths(pixelCount);
+  std::vector<Pixel> pixels(pixelCount);
+  std::vector<Pixel> filtered(pixelCount);
+
+  forEachRow(height, threadCount, [&](u32 y) {
+    for (u32 i = y * width; i < (y + 1) * width; i++) {
+      vec3 color = framebuffer.color[i] * scale;
+
+      // Channels with (almost) no albedo are left modulated
+      vec3 albedo = framebuffer.albedo[i] * scale;
+      for (u32 c = 0; c < 3; c++) {
+        albedo[c] = albedo[c] > 0.01f ? albedo[c] : 1;
+      }
+      albedos[i] = albedo;
+
+      vec3 normal = framebuffer.normal[i];
+      normals[i] = normal.length2() > 0 ? normalize(normal) : normal;
+      depths[i] = framebuffer.depth[i] * scale;
+
+      // Variance of the pixel's mean, from the spread of its samples
+      f32 mean = luminance(color);
+      f32 meanSquare = framebuffer.luminance2[i] * scale;
+      f32 variance = max(meanSquare - mean * mean, 0) * scale;
+      f32 demodulation = max(luminance(albedo), 0.01f);
+      pixels[i].irradiance = color / albedo;
+      pixels[i].variance = variance / (demodulation * demodulation);
+    }
+  });
+
+  const f32 kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+
+  for (u32 iteration = 0; iteration < settings.iterations; iteration++) {
+    s32 step = 1 << iteration;
+
+    forEachRow(height, threadCount, [&](u32 y) {
+      for (u32 x = 0; x < width; x++) {
+        u32 center = y * width + x;
+        const Pixel& p = pixels[center];
+
+        // A 3x3 blur of the variance steadies the edge stopping
+        f32 variance = 0;
+        f32 varianceWeight = 0;
+        for (s32 dy = -1; dy <= 1; dy++) {
+          for (s32 dx = -1; dx <= 1; dx++) {
+            s32 qx = s32(x) + dx;
+            s32 qy = s32(y) + dy;
+            if (qx < 0 || qy < 0 || qx >= s32(width) || qy >= s32(height))
+              continue;
+            f32 weight = kernel[dx + 2] * kernel[dy + 2];
+            variance += weight * pixels[qy * width + qx].variance;
+            varianceWeight += weight;
+          }
+        }
+        variance /= varianceWeight;
+
+        f32 luminanceP = luminance(p.irradiance);
+        f32 luminanceScale = settings.colorPhi * sqrt(variance) + 1e-4f;
+
+        vec3 sum(0, 0, 0);
+        f32 sumVariance = 0;
+        f32 sumWeight = 0;
+        for (s32 dy = -2; dy <= 2; dy++) {
+          for (s32 dx = -2; dx <= 2; dx++) {
+            s32 qx = s32(x) + dx * step;
+            s32 qy = s32(y) + dy * step;
+            if (qx < 0 || qy < 0 || qx >= s32(width) || qy >= s32(height))
+              continue;
+
+            u32 neighbour = qy * width + qx;
+            const Pixel& q = pixels[neighbour];
+
+            f32 weight = kernel[dx + 2] * kernel[dy + 2];
+            if (neighbour != center) {
+              f32 luminanceDelta = fabs(luminanceP - luminance(q.irradiance));
+              f32 normalDot = max(dot(normals[center], normals[neighbour]), 0);
+              f32 depthDelta = fabs(depths[center] - depths[neighbour]);
+              f32 depthScale = settings.depthPhi * step *
+                                   max(depths[center], depths[neighbour]) +
+                               1e-4f;
+
+              weight *= exp(-luminanceDelta / luminanceScale -
+                            depthDelta / depthScale) *
+                        pow(normalDot, settings.normalPhi);
+            }
+
+            sum += weight * q.irradiance;
+            sumVariance += weight * weight * q.variance;
+            sumWeight += weight;
+          }
+        }
+
+        filtered[center].irradiance = sum / sumWeight;
+        filtered[center].variance = sumVariance / (sumWeight * sumWeight);
+      }
+    });
+
+    std::swap(pixels, filtered);
+  }
+
+  std::vector<vec3> result(pixelCount);
+  for (u32 i = 0; i < pixelCount; i++) {
+    result[i] = pixels[i].irradiance * albedos[i];
+  }
+  return result;
+}
+
+}  // namespace denoise
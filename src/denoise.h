@@ -0,0 +1,20 @@
+namespace denoise {
+
+// NOTE(johan): Tuning for the edge-avoiding a-trous filter. Each iteration
+// doubles the spacing between taps, so five iterations of the 5x5 kernel
+// cover about a 125 pixel wide footprint. The phi values control how quickly
+// a neighbour's weight falls off as it differs from the center pixel.
+struct Settings {
+  u32 iterations;
+  f32 colorPhi;   // In standard deviations of the estimated noise
+  f32 normalPhi;  // Exponent on the cosine between normals
+  f32 depthPhi;   // Fraction of the depth, per step of tap spacing
+};
+
+// The per-pixel inputs to one filter iteration
+struct Pixel {
+  vec3 irradiance;  // Color with the albedo divided out
+  f32 variance;     // Of the irradiance luminance
+};
+
+}  // namespace denoise
@@ -19,7 +19,15 @@ bool findHit(const Sphere& sphere,
     if (t < tMax && t > tMin) {
       hit.t = t;
       hit.p = rayAt(ray, t);
-      hit.normal = normalize((hit.p - sphere.center) / sphere.radius);
+      hit.normal = (hit.p - sphere.center) * sphere.inverseRadius;
+
+      // Spherical uv, u wraps around y starting from -x and v runs bottom to
+      // top. uvScale is roughly how far uv moves per unit on the surface.
+      f32 phi = atan2(hit.normal.z, hit.normal.x);
+      f32 theta = asin(max(min(hit.normal.y, 1), -1));
+      hit.u = 1 - (phi + M_PI) / (2 * M_PI);
+      hit.v = (theta + M_PI / 2) / M_PI;
+      hit.uvScale = M_1_PI * sphere.inverseRadius;
       return true;
     }
   }
@@ -27,16 +35,62 @@ bool findHit(const Sphere& sphere,
   return false;
 }
 
+bool findHit(const Plane& plane,
+             const camera::Ray& ray,
+             const f32 tMin,
+             const f32 tMax,
+             Hit& hit) {
+  f32 denominator = dot(ray.direction, plane.normal);
+  if (fabs(denominator) < 1e-8f)
+    return false;
+
+  f32 t = dot(plane.point - ray.origin, plane.normal) / denominator;
+  if (t >= tMax || t <= tMin)
+    return false;
+
+  vec3 p = rayAt(ray, t);
+  vec3 local = p - plane.point;
+  f32 x = dot(local, plane.tangent);
+  f32 y = dot(local, plane.bitangent);
+
+  if (plane.halfWidth > 0 || plane.halfHeight > 0) {
+    if (fabs(x) > plane.halfWidth || fabs(y) > plane.halfHeight)
+      return false;
+    hit.u = 0.5f + x / (2 * plane.halfWidth);
+    hit.v = 0.5f + y / (2 * plane.halfHeight);
+    hit.uvScale = 1 / (2 * max(plane.halfWidth, plane.halfHeight));
+  } else {
+    // Infinite planes repeat their uv every world unit
+    hit.u = x - floor(x);
+    hit.v = y - floor(y);
+    hit.uvScale = 1;
+  }
+
+  // Planes are two sided, so the normal always faces back along the ray
+  hit.t = t;
+  hit.p = p;
+  hit.normal = denominator < 0 ? plane.normal : -plane.normal;
+  return true;
+}
+
+// With SpheresOnly the caller promises every entity is a sphere, so there's
+// no type switch at all
+template <bool SpheresOnly = false>
 bool findHit(const Entity* entity,
              const camera::Ray& ray,
              const f32 tMin,
              const f32 tMax,
              Hit& hit) {
   hit.material = entity->material;
+  if (SpheresOnly)
+    return findHit(entity->sphere, ray, tMin, tMax, hit);
+
   switch (entity->type) {
     case EntityType::Sphere:
       return findHit(entity->sphere, ray, tMin, tMax, hit);
-  }
+    case EntityType::Plane:
+      return findHit(entity->plane, ray, tMin, tMax, hit);
+  }  return false;
 }
 
 bool getBoundingBox(const Sphere& sphere, bvh::AABB& box) {
@@ -46,11 +100,82 @@ bool getBoundingBox(const Sphere& sphere, bvh::AABB& box) {
   return true;
 }
 
+bool getBoundingBox(const Plane& plane, bvh::AABB& box) {
+  if (plane.halfWidth <= 0 && plane.halfHeight <= 0)
+    return false;
+
+  // Padded a little, so an axis aligned rectangle's box isn't flat
+  vec3 padding(1e-4f, 1e-4f, 1e-4f);
+  vec3 corner = plane.point - plane.halfWidth * plane.tangent -
+                plane.halfHeight * plane.bitangent;
+  box = bvh::createAABB(corner - padding, corner + padding);
+  for (u32 i = 1; i < 4; i++) {
+    corner = plane.point +
+             (i & 1 ? 1 : -1) * plane.halfWidth * plane.tangent +
+             (i & 2 ? 1 : -1) * plane.halfHeight * plane.bitangent;
+    box = bvh::surroundingBox(
+        box, bvh::createAABB(corner - padding, corner + padding));
+  }
+  return true;
+}
+
 bool getBoundingBox(const Entity* entity, bvh::AABB& box) {
   switch (entity->type) {
     case EntityType::Sphere:
       return getBoundingBox(entity->sphere, box);
+    case EntityType::Plane:
+      return getBoundingBox(entity->plane, box);
+  }  return false;
+}
+
+// The exact box of the part of a sphere inside clip. Along each axis the
+// extremes are where the sphere is widest once the other two axes are pulled
+// into clip.
+bool getClippedBoundingBox(const Sphere& sphere,
+                           const bvh::AABB& clip,
+                           bvh::AABB& box) {
+  f32 distances[3];
+  for (u32 axis = 0; axis < 3; axis++) {
+    f32 c = sphere.center[axis];
+    f32 d = max(clip.minPoint[axis] - c, 0) + max(c - clip.maxPoint[axis], 0);
+    distances[axis] = d * d;
+  }
+
+  for (u32 axis = 0; axis < 3; axis++) {
+    f32 others = distances[(axis + 1) % 3] + distances[(axis + 2) % 3];
+    f32 squared = sphere.radius * sphere.radius - others;
+    if (squared < 0)
+      return false;
+
+    f32 halfExtent = sqrt(squared);
+    box.minPoint[axis] =
+        max(sphere.center[axis] - halfExtent, clip.minPoint[axis]);
+    box.maxPoint[axis] =
+        min(sphere.center[axis] + halfExtent, clip.maxPoint[axis]);
+    if (box.minPoint[axis] > box.maxPoint[axis])
+      return false;
   }
+  return true;
+}
+
+// Box of the part of an entity inside clip, false if none of it is. Only
+// spheres are clipped exactly, anything else just has its box clipped.
+bool getClippedBoundingBox(const Entity* entity,
+                           const bvh::AABB& clip,
+                           bvh::AABB& box) {
+  if (entity->type == EntityType::Sphere) {
+    return getClippedBoundingBox(entity->sphere, clip, box);
+  }
+
+  if (!getBoundingBox(entity, box))
+    return false;
+  for (u32 axis = 0; axis < 3; axis++) {
+    box.minPoint[axis] = max(box.minPoint[axis], clip.minPoint[axis]);
+    box.maxPoint[axis] = min(box.maxPoint[axis], clip.maxPoint[axis]);
+    if (box.minPoint[axis] > box.maxPoint[axis])
+      return false;
+  }
+  return true;
 }
 
 Entity* createSphere(const vec3 center, const f32 radius, Material* material) {
@@ -58,8 +183,32 @@ Entity* createSphere(const vec3 center, const f32 radius, Material* material) {
   result->type = EntityType::Sphere;
   result->sphere.center = center;
   result->sphere.radius = radius;
+  result->sphere.inverseRadius = 1 / radius;
   result->material = material;
   return result;
 }
 
+// A rectangle centered on point, the tangent direction is picked arbitrarily
+Entity* createPlane(const vec3 point,
+                    const vec3 normal,
+                    const f32 halfWidth,
+                    const f32 halfHeight,
+                    Material* material) {
+  Entity* result = (Entity*)malloc(sizeof(Entity));
+  result->type = EntityType::Plane;
+  result->plane.point = point;
+  result->plane.normal = normalize(normal);
+  makeBasis(result->plane.normal, result->plane.tangent,
+            result->plane.bitangent);
+  result->plane.halfWidth = halfWidth;
+  result->plane.halfHeight = halfHeight;
+  result->material = material;
+  return result;
+}
+
+// An infinite plane through point
+Entity* createPlane(const vec3 point, const vec3 normal, Material* material) {
+  return createPlane(point, normal, 0, 0, material);
+}
+
 }  // namespace entity
@@ -1,16 +1,31 @@
 namespace entity {
 
-enum class EntityType { Sphere };
+enum class EntityType { Sphere, Plane };
 
 struct Sphere {
   vec3 center;
   f32 radius;
+  f32 inverseRadius;
+};
+
+// NOTE(johan): A plane has no bounding box when it's infinite (both half
+// sizes zero), so it can't go in a BVH and is tested against every ray
+// instead. A finite plane is a rectangle spanning halfWidth along the tangent
+// and halfHeight along the bitangent, and has a box like anything else.
+struct Plane {
+  vec3 point;
+  vec3 normal;
+  vec3 tangent;
+  vec3 bitangent;
+  f32 halfWidth;
+  f32 halfHeight;
 };
 
 struct Entity {
   EntityType type;
   union {
     Sphere sphere;
+    Plane plane;
   };
   material::Material* material;
 };
@@ -2,6 +2,7 @@ void addEntity(EntityList& entities, entity::Entity* entity) {
   entities.push_back(entity);
 }
 
+template <bool SpheresOnly = false>
 bool findHit(const EntityList& entities,
              const camera::Ray& ray,
              const f32 tMin,
@@ -12,7 +13,7 @@ bool findHit(const EntityList& entities,
   bool hasHit = false;
 
   for (auto entity : entities) {
-    if (entity::findHit(entity, ray, tMin, tClosest, entityHit)) {
+    if (entity::findHit<SpheresOnly>(entity, ray, tMin, tClosest, entityHit)) {
       hasHit = true;
       tClosest = entityHit.t;
       hit = entityHit;
@@ -22,6 +23,40 @@ bool findHit(const EntityList& entities,
   return hasHit;
 }
 
+// A sphere only scene has nothing unbounded to test
+template <bool SpheresOnly = false, typename Accelerator>
+bool findHit(const Scene<Accelerator>& scene,
+             const camera::Ray& ray,
+             const f32 tMin,
+             const f32 tMax,
+             Hit& hit) {
+  bool hasHit = findHit<SpheresOnly>(scene.accelerator, ray, tMin, tMax, hit);
+  if (!SpheresOnly &&
+      findHit(scene.unbounded, ray, tMin, hasHit ? hit.t : tMax, hit)) {
+    hasHit = true;
+  }
+  return hasHit;
+}
+
+template <typename Accelerator>
+Scene<Accelerator> createScene(const Accelerator& accelerator,
+                               const EntityList& unbounded) {
+  Scene<Accelerator> scene = {accelerator, unbounded};
+  return scene;
+}
+
+// Moves the entities that have no bounding box out into unbounded
+void splitUnbounded(EntityList& entities, EntityList& unbounded) {
+  bvh::AABB box;
+  auto firstUnbounded = std::stable_partition(
+      entities.begin(), entities.end(),
+      [&box](entity::Entity* entity) {
+        return entity::getBoundingBox(entity, box);
+      });
+  unbounded.insert(unbounded.end(), firstUnbounded, entities.end());
+  entities.erase(firstUnbounded, entities.end());
+}
+
 bool getBoundingBox(const EntityList entities, bvh::AABB& box) {
   if (entities.size() == 0)
     return false;
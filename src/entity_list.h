@@ -1,3 +1,13 @@
 #pragma once
 
-typedef std::vector<entity::Entity*> EntityList;
\ No newline at end of file
+typedef std::vector<entity::Entity*> EntityList;
+
+// NOTE(johan): Entities without a bounding box (infinite planes) can't go in an
+// acceleration structure, so a scene keeps them to one side and tests them
+// against every ray after the accelerator. That also keeps something like a
+// ground plane from blowing every box in a BVH up to its size.
+template <typename Accelerator>
+struct Scene {
+  Accelerator accelerator;
+  EntityList unbounded;
+};
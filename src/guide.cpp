@@ -0,0 +1,402 @@
+namespace guide {
+
+// Probability of sampling the BSDF rather than the guide at a diffuse bounce
+const f32 bsdfFraction = 0.5f;
+
+// A spatial leaf is split once it has had more records than this
+const u32 splitThreshold = 4000;
+
+// Quadrants holding more than this fraction of a DTree's energy get split,
+// and ones with less are merged back up
+const f32 subdivisionFraction = 0.01f;
+const u32 maxQuadDepth = 16;
+
+// Diffuse bounces recorded per path, any after that aren't
+const u32 maxGuideVertices = 4;
+
+QuadNode::QuadNode() {
+  for (u32 i = 0; i < 4; i++) {
+    sums[i] = 0;
+    children[i] = 0;
+  }
+}
+
+QuadNode::QuadNode(const QuadNode& other) {
+  *this = other;
+}
+
+QuadNode& QuadNode::operator=(const QuadNode& other) {
+  for (u32 i = 0; i < 4; i++) {
+    sums[i] = other.sums[i].load(std::memory_order_relaxed);
+    children[i] = other.children[i];
+  }
+  return *this;
+}
+
+DTree::DTree() : nodes(1), recordCount(0) {}
+
+DTree::DTree(const DTree& other) {
+  *this = other;
+}
+
+DTree& DTree::operator=(const DTree& other) {
+  nodes = other.nodes;
+  recordCount = other.recordCount.load(std::memory_order_relaxed);
+  return *this;
+}
+
+inline void atomicAdd(std::atomic<f32>& value, f32 amount) {
+  f32 current = value.load(std::memory_order_relaxed);
+  while (!value.compare_exchange_weak(current, current + amount,
+                                      std::memory_order_relaxed)) {
+  }
+}
+
+//
+// Directions
+//
+
+// Equal area mapping of a unit direction to the unit square
+inline void toSquare(const vec3& direction, f32& x, f32& y) {
+  f32 cosTheta = max(-1, min(direction.z, 1));
+  f32 phi = atan2(direction.y, direction.x);
+  x = (cosTheta + 1) * 0.5f;
+  y = (phi < 0 ? phi + 2 * M_PI : phi) * (0.5f * M_1_PI);
+  x = min(x, 0.99999994f);
+  y = min(y, 0.99999994f);
+}
+
+inline vec3 fromSquare(f32 x, f32 y) {
+  f32 cosTheta = 2 * x - 1;
+  f32 sinTheta = sqrt(max(1 - cosTheta * cosTheta, 0));
+  f32 phi = 2 * M_PI * y;
+  return vec3(sinTheta * cos(phi), sinTheta * sin(phi), cosTheta);
+}
+
+// Which quadrant a point is in, and the point within that quadrant
+inline u32 quadrant(f32& x, f32& y) {
+  u32 index = 0;
+  x *= 2;
+  y *= 2;
+  if (x >= 1) {
+    index |= 1;
+    x -= 1;
+  }
+  if (y >= 1) {
+    index |= 2;
+    y -= 1;
+  }
+  return index;
+}
+
+inline f32 total(const QuadNode& node) {
+  return node.sums[0] + node.sums[1] + node.sums[2] + node.sums[3];
+}
+
+//
+// DTree
+//
+
+void record(DTree& dtree, const vec3& direction, f32 radiance) {
+  f32 x, y;
+  toSquare(direction, x, y);
+  u32 nodeIndex = 0;
+  while (true) {
+    QuadNode& node = dtree.nodes[nodeIndex];
+    u32 i = quadrant(x, y);
+    atomicAdd(node.sums[i], radiance);
+    if (!node.children[i])
+      break;
+    nodeIndex = node.children[i];
+  }
+  dtree.recordCount.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Solid angle pdf of sample() giving direction
+f32 pdf(const DTree& dtree, const vec3& direction) {
+  f32 x, y;
+  toSquare(direction, x, y);
+  f32 density = 1;
+  u32 nodeIndex = 0;
+  while (true) {
+    const QuadNode& node = dtree.nodes[nodeIndex];
+    f32 nodeTotal = total(node);
+    if (nodeTotal <= 0)
+      return 0;
+    u32 i = quadrant(x, y);
+    density *= 4 * node.sums[i] / nodeTotal;
+    if (!node.children[i])
+      break;
+    nodeIndex = node.children[i];
+  }
+  return density * (0.25f * M_1_PI);
+}
+
+// A direction from the distribution, along with the pdf() of it worked out
+// on the way down
+vec3 sample(const DTree& dtree, f32& samplePdf) {
+  f32 x = 0, y = 0;
+  f32 size = 1;
+  f32 density = 1;
+  u32 nodeIndex = 0;
+  while (true) {
+    const QuadNode& node = dtree.nodes[nodeIndex];
+    f32 nodeTotal = total(node);
+    f32 r = randomUnit() * nodeTotal;
+    u32 i = 0;
+    while (i < 3 && r >= node.sums[i]) {
+      r -= node.sums[i];
+      i++;
+    }
+
+    density *= 4 * node.sums[i] / nodeTotal;
+    size *= 0.5f;
+    x += (i & 1) ? size : 0;
+    y += (i & 2) ? size : 0;
+    if (!node.children[i])
+      break;
+    nodeIndex = node.children[i];
+  }
+  samplePdf = density * (0.25f * M_1_PI);
+  return fromSquare(x + randomUnit() * size, y + randomUnit() * size);
+}
+
+// Copies the quadrant at index into a new tree, split wherever the energy is
+// more than subdivisionFraction of all of it. Quadrants split further than
+// the old tree went share their parent's energy equally. The new tree starts
+// out empty, only its shape comes from the old one.
+void refine(const DTree& old,
+            u32 oldIndex,
+            f32 energy,
+            f32 totalEnergy,
+            u32 depth,
+            DTree& refined,
+            u32 index) {
+  for (u32 i = 0; i < 4; i++) {
+    f32 quadrantEnergy = energy / 4;
+    u32 oldChild = 0;
+    if (oldIndex != u32(-1)) {
+      quadrantEnergy = old.nodes[oldIndex].sums[i];
+      oldChild = old.nodes[oldIndex].children[i];
+    }
+
+    if (depth < maxQuadDepth &&
+        quadrantEnergy > totalEnergy * subdivisionFraction) {
+      u32 child = refined.nodes.size();
+      refined.nodes.push_back(QuadNode());
+      refined.nodes[index].children[i] = child;
+      refine(old, oldChild ? oldChild : u32(-1), quadrantEnergy, totalEnergy,
+             depth + 1, refined, child);
+    }
+  }
+}
+
+DTree refine(const DTree& old) {
+  DTree refined;
+  f32 totalEnergy = total(old.nodes[0]);
+  if (totalEnergy > 0) {
+    refine(old, 0, totalEnergy, totalEnergy, 1, refined, 0);
+  }
+  return refined;
+}
+
+//
+// SD-tree
+//
+
+Guide* createGuide(const bvh::AABB& bounds, const camera::Camera* camera) {
+  Guide* guide = new Guide();
+
+  bvh::AABB box = bvh::surroundingBox(
+      bounds, bvh::createAABB(camera->origin, camera->origin));
+
+  // NOTE(johan): A cube, so cycling the split axis keeps the leaves roughly
+  // cube shaped too
+  vec3 center = 0.5f * (box.minPoint + box.maxPoint);
+  vec3 extent = box.maxPoint - box.minPoint;
+  f32 halfSize = 0.5f * max(extent.x, max(extent.y, extent.z)) * 1.01f;
+  vec3 half(halfSize, halfSize, halfSize);
+  guide->box = bvh::createAABB(center - half, center + half);
+
+  guide->spatial.push_back({0, {0, 0}, 0});
+  guide->sampling.push_back(DTree());
+  guide->recording.push_back(DTree());
+  guide->iteration = 0;
+  guide->training = true;
+  return guide;
+}
+
+// The DTree for the leaf containing position. Positions outside the box,
+// such as on infinite planes, use the leaf nearest to them.
+u32 findLeaf(const Guide* guide, const vec3& position) {
+  vec3 minPoint = guide->box.minPoint;
+  vec3 maxPoint = guide->box.maxPoint;
+  u32 nodeIndex = 0;
+  while (guide->spatial[nodeIndex].children[0]) {
+    const SpatialNode& node = guide->spatial[nodeIndex];
+    f32 middle = 0.5f * (minPoint[node.axis] + maxPoint[node.axis]);
+    if (position[node.axis] < middle) {
+      maxPoint[node.axis] = middle;
+      nodeIndex = node.children[0];
+    } else {
+      minPoint[node.axis] = middle;
+      nodeIndex = node.children[1];
+    }
+  }
+  return guide->spatial[nodeIndex].dtree;
+}
+
+// Splits leaves with more than splitThreshold records, each half taking a
+// copy of its DTree with half the records
+void splitLeaves(Guide* guide, u32 nodeIndex) {
+  SpatialNode node = guide->spatial[nodeIndex];
+  if (node.children[0]) {
+    splitLeaves(guide, node.children[0]);
+    splitLeaves(guide, node.children[1]);
+    return;
+  }
+
+  DTree& dtree = guide->recording[node.dtree];
+  if (dtree.recordCount <= splitThreshold)
+    return;
+  dtree.recordCount = dtree.recordCount / 2;
+
+  u32 children[2];
+  for (u32 i = 0; i < 2; i++) {
+    children[i] = guide->spatial.size();
+    u32 dtreeIndex = i == 0 ? node.dtree : guide->recording.size();
+    if (i == 1) {
+      guide->recording.push_back(guide->recording[node.dtree]);
+    }
+    guide->spatial.push_back({(node.axis + 1) % 3, {0, 0}, dtreeIndex});
+  }
+  guide->spatial[nodeIndex].children[0] = children[0];
+  guide->spatial[nodeIndex].children[1] = children[1];
+
+  splitLeaves(guide, children[0]);
+  splitLeaves(guide, children[1]);
+}
+
+// NOTE(johan): Call between passes, never during one. What was recorded
+// becomes what's sampled, and recording starts over with trees refined to
+// match. Once training is false nothing is recorded any more and the
+// distributions stay as they are.
+void update(Guide* guide, bool training) {
+  splitLeaves(guide, 0);
+  guide->sampling = guide->recording;
+  for (auto& dtree : guide->recording) {
+    dtree = refine(dtree);
+  }
+  guide->iteration++;
+  guide->training = training;
+}
+
+// Queues up the radiance a path found beyond each of its diffuse bounces
+// to be recorded by recordBatch()
+void recordPath(const Guide* guide,
+                const GuideVertex* vertices,
+                u32 vertexCount,
+                const vec3& contribution,
+                std::vector<GuideRecord>& records) {
+  for (u32 i = 0; i < vertexCount; i++) {
+    const GuideVertex& vertex = vertices[i];
+    vec3 radiance(
+        vertex.throughput.x > 0 ? contribution.x / vertex.throughput.x : 0,
+        vertex.throughput.y > 0 ? contribution.y / vertex.throughput.y : 0,
+        vertex.throughput.z > 0 ? contribution.z / vertex.throughput.z : 0);
+    f32 value = luminance(radiance);
+    if (value > 0 && std::isfinite(value)) {
+      u32 dtree = vertex.dtree != noDTree ? vertex.dtree
+                                          : findLeaf(guide, vertex.position);
+      records.push_back({dtree, vertex.direction, value});
+    }
+  }
+}
+
+// NOTE(johan): Records a batch's worth of paths at once, sorted by DTree so
+// that each tree stays in cache while all of its records go in rather than
+// every record walking a cold tree somewhere else.
+void recordBatch(Guide* guide, std::vector<GuideRecord>& records) {
+  std::sort(records.begin(), records.end(),
+            [](const GuideRecord& a, const GuideRecord& b) {
+              return a.dtree < b.dtree;
+            });
+  for (const GuideRecord& queued : records) {
+    record(guide->recording[queued.dtree], queued.direction, queued.radiance);
+  }
+  records.clear();
+}
+
+// NOTE(johan): One sample MIS between the BSDF and the guide, so either can
+// produce a direction and the weight uses the pdf of the mix. Only diffuse
+// bounces are guided, the specular ones have no pdf to mix with. Where the
+// guide hasn't learned anything yet it's the plain BSDF sample. The DTree
+// looked up for each hit goes in dtrees, so recording needn't find it again.
+void sampleDiffuseBatch(const Guide* guide,
+                        const camera::Ray* rays,
+                        const Hit* hits,
+                        u32 count,
+                        material::BsdfSample* samples,
+                        u8* scattered,
+                        u32* dtrees) {
+  for (u32 i = 0; i < count; i++) {
+    const Hit& hit = hits[i];
+    material::BsdfSample& sample = samples[i];
+    dtrees[i] = findLeaf(guide, hit.p);
+    const DTree& dtree = guide->sampling[dtrees[i]];
+    if (total(dtree.nodes[0]) <= 0) {
+      scattered[i] = material::sample(hit.material, rays[i], hit, sample);
+      continue;
+    }
+
+    // NOTE(johan): A leaf holds surfaces facing every which way, so the guide
+    // learns light from all around and some of its samples go below the
+    // surface. Those are reflected back above it instead of being wasted,
+    // which makes the guide's pdf its own plus that of the mirror direction.
+    // Sampling the guide gives the pdf of what it picked on the way down.
+    vec3 wo = -normalize(rays[i].direction);
+    f32 guidePdf;
+    if (randomUnit() < bsdfFraction) {
+      if (!material::sample(hit.material, rays[i], hit, sample)) {
+        scattered[i] = 0;
+        continue;
+      }
+      guidePdf = pdf(dtree, sample.direction) +
+                 pdf(dtree, reflect(sample.direction, hit.normal));
+    } else {
+      f32 sampledPdf;
+      vec3 sampled = guide::sample(dtree, sampledPdf);
+      sample.direction = dot(sampled, hit.normal) < 0
+                             ? reflect(sampled, hit.normal)
+                             : sampled;
+      guidePdf = sampledPdf + pdf(dtree, reflect(sampled, hit.normal));
+    }
+
+    f32 cosine = dot(sample.direction, hit.normal);
+    f32 mixedPdf =
+        bsdfFraction *
+            material::pdf(hit.material, hit, wo, sample.direction) +
+        (1 - bsdfFraction) * guidePdf;
+    if (cosine <= 0 || mixedPdf <= 0) {
+      scattered[i] = 0;
+      continue;
+    }
+
+    sample.weight =
+        material::eval(hit.material, hit, wo, sample.direction) * cosine /
+        mixedPdf;
+    sample.pdf = mixedPdf;
+    sample.specular = false;
+    scattered[i] = 1;
+  }
+}
+
+// Trains while fewer than half of totalSamples have been taken, call after
+// each pass with the samples taken so far
+void endPass(Guide* guide, u32 samples, u32 totalSamples) {
+  if (guide->training) {
+    update(guide, samples < totalSamples / 2);
+  }
+}
+
+}  // namespace guide
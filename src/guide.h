@@ -0,0 +1,70 @@
+namespace guide {
+
+// NOTE(johan): A node of a directional quadtree. Directions are mapped to the
+// unit square with an equal area (cylindrical) mapping, and each node splits
+// its part of the square into four quadrants. The sums are the radiance
+// recorded in each quadrant, added to concurrently by the render threads.
+struct QuadNode {
+  std::atomic<f32> sums[4];
+  u32 children[4];  // Index of each quadrant's node, zero for none
+
+  QuadNode();
+  QuadNode(const QuadNode& other);
+  QuadNode& operator=(const QuadNode& other);
+};
+
+// The directional distribution of light arriving in one region of space
+struct DTree {
+  std::vector<QuadNode> nodes;  // Root first
+  std::atomic<u32> recordCount;
+
+  DTree();
+  DTree(const DTree& other);
+  DTree& operator=(const DTree& other);
+};
+
+// NOTE(johan): A node of the spatial binary tree, leaves own a DTree. Each
+// level splits its box in half, cycling through the axes.
+struct SpatialNode {
+  u32 axis;
+  u32 children[2];  // Both zero for a leaf
+  u32 dtree;
+};
+
+// NOTE(johan): Path guiding after Müller et al., "Practical Path Guiding for
+// Efficient Light-Transport Simulation". An SD-tree (a spatial binary tree
+// with a directional quadtree in each leaf) learns where light arrives from
+// as rendering goes on. Diffuse bounces then sample directions from a mix of
+// that and the BSDF. Each DTree is kept twice, one being sampled from that's
+// read only during a pass and one being recorded into, and update() swaps
+// the recorded one in and refines the trees between passes.
+struct Guide {
+  bvh::AABB box;  // A cube around the scene
+  std::vector<SpatialNode> spatial;
+  std::vector<DTree> sampling;
+  std::vector<DTree> recording;
+  u32 iteration;
+  bool training;  // Paths are only recorded while training
+};
+
+// For a GuideVertex whose DTree hasn't been looked up
+const u32 noDTree = u32(-1);
+
+// A diffuse bounce along a path, kept so the radiance the path eventually
+// finds can be recorded there
+struct GuideVertex {
+  vec3 position;
+  vec3 direction;
+  vec3 throughput;  // Of the path just after this bounce
+  u32 dtree;        // The leaf's DTree if sampling found it, or noDTree
+};
+
+// Radiance found in direction from somewhere in the leaf with this DTree,
+// waiting to be recorded there
+struct GuideRecord {
+  u32 dtree;
+  vec3 direction;
+  f32 radiance;
+};
+
+}  // namespace guide
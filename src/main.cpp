@@ -8,8 +8,43 @@
 #include <fstream>
 #include <vector>
 #include <algorithm>
+#include <functional>
+#include <string>
+#include <list>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <limits>
+#include <string.h>
+#include <signal.h>
+#include <thread>
+#include <condition_variable>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <chrono>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
 
-#define USE_BVH 1
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define USE_SIMD 1
+#else
+#define USE_SIMD 0
+#endif
+
+#define USE_SPATIAL_SPLITS 1
 
 // TODO(johan): Better error handling
 inline void fatal(const char* msg) {
@@ -20,323 +55,373 @@ inline void fatal(const char* msg) {
 #include "types.h"
 #include "math.h"
 #include "camera.h"
+#include "texture.h"
 #include "material.h"
 #include "entity.h"
 #include "entity_list.h"
 #include "bvh.h"
+#include "paging.h"
+#include "guide.h"
 
 struct Hit {
   f32 t;
   vec3 p;
   vec3 normal;
+  f32 u, v;
+  f32 uvScale;    // Surface uv units per world unit, set by the entity
+  f32 coneWidth;  // Ray footprint at the hit, set by the integrator
   material::Material* material;
 };
 
+#include "numa.h"
+#include "render.h"
+#include "preview.h"
+#include "denoise.h"
+#include "scenes.h"
+#include "service.h"
+#include "views.h"
+
 // NOTE(johan): This is a "unity" build, there's only one translation unit and
 // the linker has very little work to do.
 #include "camera.cpp"
+#include "texture.cpp"
 #include "material.cpp"
 #include "entity.cpp"
 #include "entity_list.cpp"
 #include "bvh.cpp"
+#include "paging.cpp"
+#include "guide.cpp"
+#include "numa.cpp"
+#include "render.cpp"
+#include "preview.cpp"
+#include "denoise.cpp"
+#include "scenes.cpp"
+#include "service.cpp"
+#include "views.cpp"
+#include "bench.cpp"
+#include "converge.cpp"
+
+u64 textureCacheBytes = 64 * 1024 * 1024;
+
+struct Options {
+  render::RenderSettings settings;
+  const char* scene;
+  scenes::AcceleratorType acceleratorType;
+  u16 previewPort;             // Zero renders straight to test.ppm instead
+  const char* socketPath;      // Runs as a service when set
+  bool numa;                   // Pin threads and place memory by NUMA node
+  bool replicate;              // Also copy the scene onto every node
+  numa::Placement* placement;  // Made from the above in main()
+  const char* chunkDirectory;  // For AcceleratorType::OutOfCore
+  bool writeChunks;            // Write chunkDirectory instead of rendering
+  u64 chunkBudget;             // Bytes of chunks to keep mapped
+  u32 chunkSize;               // Spheres per chunk
+  bool writeAovs;
+  bool runBenchmarks;
+  const char* convergeDirectory;  // Runs the convergence harness when set
+  bool guide;                     // Path guiding, see guide.h
+  const char* views;              // Renders several views when set
+};
 
-u32 imageWidth = 480;
-u32 imageHeight = 270;
-u32 samples = 100;  // 200;
-u32 maxDepth = 50;  // 100;
-
-camera::Camera* mainCamera;
-EntityList worldEntities;
-
-#if !USE_BVH
-vec3 cast(const EntityList& entities, const camera::Ray& ray, u32 depth = 0) {
-  Hit hit;
-
-  // Epsilon for ignoring hits around t = 0
-  f32 tMin = 0.001f;
+// Averages the framebuffer down to 8 bit RGB, denoising it first if asked
+void resolveOutput(const render::Framebuffer& framebuffer,
+                   const render::RenderSettings& settings,
+                   std::vector<u8>& rgb) {
+  if (settings.denoise) {
+    std::vector<vec3> denoised = denoise::denoise(
+        framebuffer, denoise::defaultSettings(), settings.threadCount);
+    render::resolve(denoised.data(), framebuffer.width, framebuffer.height, 1,
+                    rgb);
+  } else {
+    render::resolve(framebuffer, rgb);
+  }
+}
 
-  if (findHit(entities, ray, tMin, FLT_MAX, hit)) {
-    camera::Ray scattered;
-    vec3 attenuation;
+void renderImage(const scenes::LoadedScene* scene, const Options& options) {
+  const render::RenderSettings& settings = options.settings;
+  camera::Camera* camera =
+      camera::resize(scene->camera, settings.width, settings.height);
+  guide::Guide* guide =
+      options.guide ? guide::createGuide(scene->bounds, camera) : nullptr;
+  render::RowRenderer renderRow =
+      scenes::createRowRenderer(scene, camera, settings.maxDepth, guide);
+  render::Framebuffer* framebuffer =
+      render::createFramebuffer(settings.width, settings.height);
+
+  const numa::Placement* placement = options.placement;
+  std::vector<numa::NodeCounters> counters;
+  if (placement) {
+    render::placeRows(*framebuffer, placement);
+    counters = numa::readCounters(placement);
+  }
 
-    if (depth < maxDepth &&
-        material::scatter(hit.material, ray, hit, attenuation, scattered)) {
-      return attenuation * cast(entities, scattered, depth + 1);
-    } else {
-      return vec3(0, 0, 0);
+  // Ten passes, so the progress digits count up like they always have
+  u32 passSamples = std::max(settings.samples / 10, 1u);
+  for (u32 pass = 0; framebuffer->samples < settings.samples; pass++) {
+    u32 passSize =
+        std::min(passSamples, settings.samples - framebuffer->samples);
+    render::renderPass(renderRow, *framebuffer, passSize,
+                       settings.threadCount, nullptr, placement);
+    if (guide) {
+      guide::endPass(guide, framebuffer->samples, settings.samples);
     }
+    std::cerr << std::min(pass, 9u);
+  }
+  std::cerr << std::endl;
 
-    // Visualise normals
-    // return 0.5f * vec3(hit.normal.x + 1, hit.normal.y + 1, hit.normal.z +
-    // 1);
+  if (placement) {
+    numa::printCounters(placement, counters, numa::readCounters(placement));
+  }
+  if (scene->chunks) {
+    paging::printStats(scene->chunks);
   }
 
-  vec3 unit_direction = normalize(ray.direction);
-  f32 t = 0.5f * (unit_direction.y + 1);
-  return lerp(vec3(1, 1, 1), vec3(0.5, 0.7, 1), t);
+  std::vector<u8> rgb;
+  resolveOutput(*framebuffer, settings, rgb);
+  render::writePpm(rgb, settings.width, settings.height, "test.ppm");
+  if (options.writeAovs) {
+    render::writeAovs(*framebuffer, "test");
+  }
 }
-#else
-vec3 cast(const bvh::BoundingVolume* bvh,
-          const camera::Ray& ray,
-          u32 depth = 0) {
-  Hit hit;
-
-  // Epsilon for ignoring hits around t = 0
-  f32 tMin = 0.001f;
-
-  if (findHit(bvh, ray, tMin, FLT_MAX, hit)) {
-    camera::Ray scattered;
-    vec3 attenuation;
-
-    if (depth < maxDepth &&
-        material::scatter(hit.material, ray, hit, attenuation, scattered)) {
-      return attenuation * cast(bvh, scattered, depth + 1);
-    } else {
-      return vec3(0, 0, 0);
-    }
 
-    // Visualise normals
-    // return 0.5f * vec3(hit.normal.x + 1, hit.normal.y + 1, hit.normal.z +
-    // 1);
+// Renders every view in options.views, writing test.000.ppm, test.001.ppm and
+// so on as each one finishes
+void renderViews(const scenes::LoadedScene* scene, const Options& options) {
+  const render::RenderSettings& settings = options.settings;
+  std::vector<views::View> viewList = views::parseViews(options.views);
+  if (viewList.empty()) {
+    fatal(
+        "Views must be turntable:count, stereo:separation or a file of "
+        "views");
   }
 
-  vec3 unit_direction = normalize(ray.direction);
-  f32 t = 0.5f * (unit_direction.y + 1);
-  return lerp(vec3(1, 1, 1), vec3(0.5, 0.7, 1), t);
+  auto start = std::chrono::steady_clock::now();
+  views::render(
+      scene, viewList, settings, options.placement, options.guide,
+      [&](u32 index, const render::Framebuffer& framebuffer) {
+        char prefix[32];
+        snprintf(prefix, sizeof(prefix), "test.%03u", index);
+        std::vector<u8> rgb;
+        resolveOutput(framebuffer, settings, rgb);
+        render::writePpm(rgb, settings.width, settings.height,
+                         std::string(prefix) + ".ppm");
+        if (options.writeAovs) {
+          render::writeAovs(framebuffer, prefix);
+        }
+        std::cerr << "Wrote " << prefix << ".ppm\n";
+      });
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+  std::cerr << "Rendered " << viewList.size() << " views in "
+            << elapsed.count() << "ms\n";
+
+  if (scene->chunks) {
+    paging::printStats(scene->chunks);
+  }
 }
-#endif
 
-void testWorld() {
-  addEntity(worldEntities,
-            entity::createSphere(vec3(0, -1000, 0), 1000,
-                                 material::createDiffuse(vec3(0.5, 0.5, 0.5))));
-
-  addEntity(
-      worldEntities,
-      entity::createSphere(vec3(0, 1, 0), 1, material::createDielectric(1.5)));
-  addEntity(worldEntities,
-            entity::createSphere(vec3(-3, 1, 0), 1,
-                                 material::createDiffuse(vec3(0.4, 0.2, 0.1))));
-  addEntity(worldEntities, entity::createSphere(
-                               vec3(3, 1, 0), 1,
-                               material::createMetal(vec3(0.7, 0.6, 0.5), 1)));
-
-  // addEntity(worldEntities, entity::createSphere(
-  //     vec3(0, 0, -1), 0.5f, material::createDiffuse(vec3(0.1f, 0.2f,
-  //     0.5f))));
-
-  // addEntity(worldEntities, entity::createSphere(
-  //     vec3(0, -100.5f, -1), 100, material::createDiffuse(vec3(0.8f, 0.8f,
-  //     0))));
-
-  // addEntity(worldEntities, entity::createSphere(
-  //     vec3(1, 0, -1), 0.5f, material::createMetal(vec3(0.8f, 0.6f, 0.2f),
-  //     1)));
-
-  // addEntity(worldEntities, entity::createSphere(vec3(-1, 0, -1), 0.5f,
-  //                                       material::createDielectric(1.5f)));
-
-  vec3 up(0, 1, 0);
-  vec3 origin(0, 1, 3);
-  vec3 lookAt(0, 0, -1);
-  f32 aperture = 0.1;
-  f32 focusDistance = 2.5;  //(origin - lookAt).length();
-  mainCamera = camera::createCamera(origin, lookAt, up, imageWidth, imageHeight,
-                                    60, aperture, focusDistance);
-}
+// NOTE(johan): Renders one sample per pixel at a time for as long as the
+// process runs, publishing every pass to the preview server. Moving the
+// camera cancels the pass in flight and starts accumulating again, so the
+// first frames after a move are rough but quick.
+void runPreview(const scenes::LoadedScene* scene, const Options& options) {
+  const render::RenderSettings& settings = options.settings;
+  preview::Server* server = preview::startServer(options.previewPort);
+  std::cerr << "Preview at http://localhost:" << options.previewPort << "/\n";
+
+  camera::Camera* camera =
+      camera::resize(scene->camera, settings.width, settings.height);
+  render::RowRenderer renderRow =
+      scenes::createRowRenderer(scene, camera, settings.maxDepth);
+  render::Framebuffer* framebuffer =
+      render::createFramebuffer(settings.width, settings.height);
+  if (options.placement) {
+    render::placeRows(*framebuffer, options.placement);
+  }
 
-void diffuseDemo() {
-  addEntity(worldEntities,
-            entity::createSphere(vec3(0, -1000, 0), 1000,
-                                 material::createDiffuse(vec3(0.1, 0.1, 0.1))));
-
-  addEntity(worldEntities,
-            entity::createSphere(vec3(-2, 1, -1), 1,
-                                 material::createDiffuse(vec3(0.5, 0.5, 0.5))));
-  addEntity(worldEntities, entity::createSphere(
-                               vec3(0, 1, -1), 1,
-                               material::createDiffuse(vec3(0.2, 0.45, 0.85))));
-  addEntity(worldEntities,
-            entity::createSphere(vec3(2, 1, -1), 1,
-                                 material::createDiffuse(vec3(0.5, 0.5, 0.5))));
-
-  vec3 up(0, 1, 0);
-  vec3 origin(0, 2, 6);
-  vec3 lookAt(0, 1.2, -1);
-  f32 aperture = 0.1;
-  f32 focusDistance = (origin - lookAt).length();
-  mainCamera = camera::createCamera(origin, lookAt, up, 30, imageWidth,
-                                    imageHeight, aperture, focusDistance);
-}
+  while (true) {
+    preview::CameraMove move;
+    if (preview::takeMove(server, move)) {
+      camera::Camera* moved =
+          camera::orbit(camera, move.yaw, move.pitch, move.dolly);
+      renderRow = scenes::createRowRenderer(scene, moved, settings.maxDepth);
+      free(camera);
+      camera = moved;
+      render::clear(*framebuffer);
+    }
 
-void metalDemo() {
-  addEntity(worldEntities,
-            entity::createSphere(vec3(0, -1000, 0), 1000,
-                                 material::createDiffuse(vec3(0.1, 0.1, 0.1))));
-
-  addEntity(worldEntities, entity::createSphere(
-                               vec3(-2, 1, -1), 1,
-                               material::createMetal(vec3(0.5, 0.5, 0.5), 1)));
-  addEntity(worldEntities, entity::createSphere(
-                               vec3(0, 1, -1), 1,
-                               material::createDiffuse(vec3(0.2, 0.45, 0.85))));
-  addEntity(worldEntities, entity::createSphere(vec3(2, 1, -1), 1,
-                                                material::createMetal(
-                                                    vec3(0.5, 0.5, 0.5), 0.3)));
-
-  vec3 up(0, 1, 0);
-  vec3 origin(0, 2, 6);
-  vec3 lookAt(0, 1.2, -1);
-  f32 aperture = 0.1;
-  f32 focusDistance = (origin - lookAt).length();
-  mainCamera = camera::createCamera(origin, lookAt, up, 30, imageWidth,
-                                    imageHeight, aperture, focusDistance);
-}
+    if (framebuffer->samples >= settings.samples) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      continue;
+    }
 
-void glassDemo() {
-  addEntity(worldEntities,
-            entity::createSphere(vec3(0, -1000, 0), 1000,
-                                 material::createDiffuse(vec3(0.1, 0.1, 0.1))));
-
-  addEntity(worldEntities,
-            entity::createSphere(vec3(-2, 1, -1), 1,
-                                 material::createDiffuse(vec3(0.5, 0.5, 0.5))));
-  addEntity(
-      worldEntities,
-      entity::createSphere(vec3(0, 1, -1), 1, material::createDielectric(1.5)));
-  addEntity(worldEntities,
-            entity::createSphere(vec3(2, 1, -1), 1,
-                                 material::createDiffuse(vec3(0.5, 0.5, 0.5))));
-
-  vec3 up(0, 1, 0);
-  vec3 origin(0, 2, 6);
-  vec3 lookAt(0, 1.2, -1);
-  f32 aperture = 0.1;
-  f32 focusDistance = (origin - lookAt).length();
-  mainCamera = camera::createCamera(origin, lookAt, up, 30, imageWidth,
-                                    imageHeight, aperture, focusDistance);
+    if (render::renderPass(renderRow, *framebuffer, 1, settings.threadCount,
+                           &server->restart, options.placement)) {
+      std::vector<u8> rgb;
+      resolveOutput(*framebuffer, settings, rgb);
+      preview::publishFrame(server, rgb, settings.width, settings.height);
+    } else {
+      render::clear(*framebuffer);
+    }
+  }
 }
 
-void spheresWorld() {
-  addEntity(worldEntities,
-            entity::createSphere(vec3(0, -1000, 0), 1000,
-                                 material::createDiffuse(vec3(0.5, 0.5, 0.5))));
-
-  for (s32 a = -11; a < 11; a++) {
-    for (s32 b = -11; b < 11; b++) {
-      f32 chooseMat = drand48();
-      vec3 center(a + 0.9 * drand48(), 0.2, b + 0.9 * drand48());
-      if ((center - vec3(4, 0.2, 0)).length() > 0.9) {
-        if (chooseMat < 0.8) {
-          addEntity(worldEntities,
-                    entity::createSphere(
-                        center, 0.2,
-                        material::createDiffuse(vec3(drand48() * drand48(),
-                                                     drand48() * drand48(),
-                                                     drand48() * drand48()))));
-
-        } else if (chooseMat < 0.90) {
-          addEntity(worldEntities,
-                    entity::createSphere(
-                        center, 0.2,
-                        material::createMetal(
-                            vec3(0.5 * (1 + drand48()), 0.5 * (1 + drand48()),
-                                 0.5 * (1 + drand48())),
-                            1 - (0.5 * drand48()))));
-
-        } else {
-          addEntity(worldEntities,
-                    entity::createSphere(center, 0.2,
-                                         material::createDielectric(1.5)));
-        }
+Options parseArguments(s32 argc, char** argv) {
+  Options options = {};
+  options.settings.width = scenes::defaultWidth;
+  options.settings.height = scenes::defaultHeight;
+  options.settings.samples = 100;  // 200;
+  options.settings.maxDepth = 50;  // 100;
+  options.settings.threadCount =
+      std::max(std::thread::hardware_concurrency(), 1u);
+  options.scene = "metal";
+  options.acceleratorType = scenes::AcceleratorType::Auto;
+  options.chunkBudget = 64 * 1024 * 1024;
+  options.chunkSize = 16384;
+
+  for (s32 i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--preview")) {
+      options.previewPort = 8080;
+      if (i + 1 < argc && argv[i + 1][0] != '-') {
+        options.previewPort = atoi(argv[++i]);
+      }
+    } else if (!strcmp(argv[i], "--daemon")) {
+      options.socketPath = "/tmp/raytracer.sock";
+      if (i + 1 < argc && argv[i + 1][0] != '-') {
+        options.socketPath = argv[++i];
+      }
+    } else if (!strcmp(argv[i], "--numa")) {
+      options.numa = true;
+      if (i + 1 < argc && !strcmp(argv[i + 1], "replicate")) {
+        options.replicate = true;
+        i++;
       }
+    } else if (!strcmp(argv[i], "--out-of-core") && i + 1 < argc) {
+      options.chunkDirectory = argv[++i];
+    } else if (!strcmp(argv[i], "--write-chunks") && i + 1 < argc) {
+      options.chunkDirectory = argv[++i];
+      options.writeChunks = true;
+    } else if (!strcmp(argv[i], "--chunk-budget") && i + 1 < argc) {
+      options.chunkBudget = u64(max(atof(argv[++i]), 0) * 1024 * 1024);
+    } else if (!strcmp(argv[i], "--chunk-size") && i + 1 < argc) {
+      options.chunkSize = std::max(atoi(argv[++i]), 1);
+    } else if (!strcmp(argv[i], "--views") && i + 1 < argc) {
+      options.views = argv[++i];
+    } else if (!strcmp(argv[i], "--scene") && i + 1 < argc) {
+      options.scene = argv[++i];
+    } else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+      options.settings.threadCount = std::max(atoi(argv[++i]), 1);
+    } else if (!strcmp(argv[i], "--samples") && i + 1 < argc) {
+      options.settings.samples = std::max(atoi(argv[++i]), 1);
+    } else if (!strcmp(argv[i], "--denoise")) {
+      options.settings.denoise = true;
+    } else if (!strcmp(argv[i], "--guide")) {
+      options.guide = true;
+    } else if (!strcmp(argv[i], "--aovs")) {
+      options.writeAovs = true;
+    } else if (!strcmp(argv[i], "--bench")) {
+      options.runBenchmarks = true;
+    } else if (!strcmp(argv[i], "--converge")) {
+      options.convergeDirectory = "convergence";
+      if (i + 1 < argc && argv[i + 1][0] != '-') {
+        options.convergeDirectory = argv[++i];
+      }
+    } else if (!strcmp(argv[i], "--accelerator") && i + 1 < argc) {
+      const char* name = argv[++i];
+      if (!strcmp(name, "list")) {
+        options.acceleratorType = scenes::AcceleratorType::List;
+      } else if (!strcmp(name, "bvh")) {
+        options.acceleratorType = scenes::AcceleratorType::Bvh;
+      } else if (!strcmp(name, "compact")) {
+        options.acceleratorType = scenes::AcceleratorType::CompactBvh;
+      } else {
+        fatal("Accelerator must be list, bvh or compact");
+      }
+    } else {
+      fatal(
+          "Usage: main [--scene name] [--preview [port]] [--daemon [path]] "
+          "[--views spec] [--threads count] [--samples count] [--denoise] "
+          "[--guide] [--aovs] [--numa [replicate]] [--bench] "
+          "[--converge [directory]] [--accelerator list|bvh|compact] "
+          "[--out-of-core directory] [--write-chunks directory] "
+          "[--chunk-budget megabytes] [--chunk-size spheres]");
     }
   }
-
-  addEntity(
-      worldEntities,
-      entity::createSphere(vec3(0, 1, 0), 1, material::createDielectric(1.5)));
-  addEntity(worldEntities,
-            entity::createSphere(vec3(-4, 1, 0), 1,
-                                 material::createDiffuse(vec3(0.4, 0.2, 0.1))));
-  addEntity(worldEntities, entity::createSphere(
-                               vec3(4, 1, 0), 1,
-                               material::createMetal(vec3(0.7, 0.6, 0.5), 1)));
-
-  vec3 up(0, 1, 0);
-  vec3 origin(13, 2, 3);
-  vec3 lookAt(0, 0, 0);
-  f32 aperture = 0.0;
-  f32 focusDistance = 10;
-  mainCamera = camera::createCamera(origin, lookAt, up, 20, imageWidth,
-                                    imageHeight, aperture, focusDistance);
+  return options;
 }
 
-void printBvh(bvh::BoundingVolume* bvh, u32 depth = 0) {
-  auto spacer = std::string(depth * 4, ' ');
-  std::cout << spacer << bvh->entities.size() << " entities ["
-            << bvh->box.minPoint << ", " << bvh->box.maxPoint << "]\n";
-  if (bvh->left) {
-    printBvh(bvh->left, depth + 1);
+s32 main(s32 argc, char** argv) {
+  Options options = parseArguments(argc, argv);
+  if (options.runBenchmarks) {
+    bench::run();
+    return 0;
   }
-  if (bvh->right) {
-    printBvh(bvh->right, depth + 1);
-  }
-}
 
-s32 main() {
-  // spheresWorld();
-  // testWorld();
-  // diffuseDemo();
-  metalDemo();
-  // glassDemo();
-
-#if USE_BVH
-  auto bvh = new bvh::BoundingVolume(worldEntities);
-  // printBvh(bvh);
-#endif
+  texture::textureCache = texture::createTextureCache(textureCacheBytes);
 
-  std::ofstream outfile("test.ppm", std::ios_base::out);
+  if (options.convergeDirectory) {
+    converge::run(options.convergeDirectory, options.acceleratorType,
+                  options.settings, options.guide);
+    return 0;
+  }
 
-  outfile << "P3\n" << imageWidth << " " << imageHeight << "\n255\n";
+  if (options.writeChunks) {
+    options.acceleratorType = scenes::AcceleratorType::Bvh;
+  } else if (options.chunkDirectory) {
+    options.acceleratorType = scenes::AcceleratorType::OutOfCore;
+  }
+  if (options.numa) {
+    options.placement = numa::createPlacement(options.settings.threadCount);
+    std::cerr << "Placing " << options.settings.threadCount
+              << " threads over " << options.placement->nodeCount
+              << " NUMA nodes\n";
+  }
 
-  u32 lastPercent = 0;
-  for (s32 y = imageHeight - 1; y >= 0; y--) {
-    u32 percent = ((imageHeight - y) / f32(imageHeight)) * 9.99f;
-    if (percent != lastPercent) {
-      lastPercent = percent;
-      std::cerr << percent;
+  if (options.socketPath) {
+    if (options.chunkDirectory) {
+      fatal("The service can't render out of core");
     }
+    if (options.guide) {
+      fatal("The service can't guide paths");
+    }
+    service::run(options.socketPath, options.acceleratorType,
+                 options.settings.threadCount, options.placement,
+                 options.replicate);
+    return 0;
+  }
 
-    for (s32 x = 0; x < imageWidth; x++) {
-      vec3 color(0, 0, 0);
-
-      // Cast rays, collecting samples
-      for (s32 sampleIndex = 0; sampleIndex < samples; sampleIndex++) {
-        f32 u = f32(x + drand48()) / f32(imageWidth);
-        f32 v = f32(y + drand48()) / f32(imageHeight);
-
-        camera::Ray r = camera::ray(mainCamera, u, v);
-#if USE_BVH
-        color += cast(bvh, r);
-#else
-        color += cast(worldEntities, r);
-#endif
-      }
-
-      // Blend samples (anti-aliasing)
-      color /= f32(samples);
-
-      // Gamma correct (gamma 2 for now)
-      color = vec3(sqrt(color.r), sqrt(color.g), sqrt(color.b));
-
-      u32 ir = u32(255.99 * color.r);
-      u32 ib = u32(255.99 * color.b);
-      u32 ig = u32(255.99 * color.g);
+  if (options.previewPort && options.guide) {
+    fatal("The preview can't guide paths, it restarts on every move");
+  }
 
-      outfile << ir << " " << ig << " " << ib << "\n";
+  scenes::LoadedScene* scene =
+      scenes::load(options.scene, options.acceleratorType);
+  if (!scene) {
+    fatal(
+        "Scene must be test, diffuse, metal, glass, texture, spheres, "
+        "glass-stack, mirrors or dense");
+  }
+  if (options.writeChunks) {
+    if (!scenes::writeChunks(scene, options.chunkDirectory,
+                             options.chunkSize)) {
+      fatal("Only scenes of spheres can be written as chunks");
     }
+    return 0;
+  }
+  if (options.chunkDirectory &&
+      !scenes::openChunks(scene, options.chunkDirectory,
+                          options.chunkBudget)) {
+    fatal("No chunks for this scene there, write them with --write-chunks");
+  }
+  if (options.placement && options.replicate) {
+    scenes::replicate(scene, options.placement);
   }
 
-  std::cerr << std::endl;
-}
\ No newline at end of file
+  if (options.previewPort) {
+    runPreview(scene, options);
+  } else if (options.views) {
+    renderViews(scene, options);
+  } else {
+    renderImage(scene, options);
+  }
+}
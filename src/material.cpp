@@ -1,39 +1,82 @@
 namespace material {
 
-bool scatter(Diffuse& diffuse,
-             const camera::Ray& ray,
-             const Hit& hit,
-             vec3& attenuation,
-             camera::Ray& scattered) {
-  vec3 target = hit.p + hit.normal + randomPointInUnitSphere();
-  scattered = {hit.p, target - hit.p};
-  attenuation = diffuse.albedo;
-  return true;
+//
+// Diffuse
+//
+
+bool sample(Diffuse& diffuse,
+            const camera::Ray& ray,
+            const Hit& hit,
+            BsdfSample& sample) {
+  sample.direction = toWorld(randomCosineDirection(), hit.normal);
+  sample.pdf = dot(sample.direction, hit.normal) * M_1_PI;
+  // NOTE(johan): f = albedo / pi and pdf = cos / pi, so everything but the
+  // albedo cancels out.
+  sample.weight = texture::value(diffuse.albedo, hit);
+  sample.specular = false;
+  return sample.pdf > 0;
 }
 
-bool scatter(Metal& metal,
-             const camera::Ray& ray,
-             const Hit& hit,
-             vec3& attenuation,
-             camera::Ray& scattered) {
+vec3 eval(Diffuse& diffuse, const Hit& hit, const vec3& wo, const vec3& wi) {
+  if (dot(wi, hit.normal) <= 0)
+    return vec3(0, 0, 0);
+  return texture::value(diffuse.albedo, hit) * M_1_PI;
+}
+
+f32 pdf(Diffuse& diffuse, const Hit& hit, const vec3& wo, const vec3& wi) {
+  return max(dot(wi, hit.normal), 0) * M_1_PI;
+}
+
+vec3 albedo(Diffuse& diffuse, const Hit& hit) {
+  return texture::value(diffuse.albedo, hit);
+}
+
+//
+// Metal
+//
+
+bool sample(Metal& metal,
+            const camera::Ray& ray,
+            const Hit& hit,
+            BsdfSample& sample) {
   vec3 reflected = reflect(ray.direction, hit.normal);
-  scattered = {hit.p, reflected + metal.fuzziness * randomPointInUnitSphere()};
-  attenuation = metal.albedo;
-  return (dot(scattered.direction, hit.normal) > 0);
+  sample.direction = reflected + metal.fuzziness * randomPointInUnitSphere();
+  sample.weight = metal.albedo;
+  sample.pdf = 0;
+  sample.specular = true;
+  return (dot(sample.direction, hit.normal) > 0);
 }
 
-bool scatter(Dielectric& dielectric,
-             const camera::Ray& ray,
-             const Hit& hit,
-             vec3& attenuation,
-             camera::Ray& scattered) {
+// TODO(johan): The fuzzy reflection is treated as a delta lobe, a proper
+// glossy model (e.g. GGX) would give metal a real eval() and pdf().
+vec3 eval(Metal& metal, const Hit& hit, const vec3& wo, const vec3& wi) {
+  return vec3(0, 0, 0);
+}
+
+f32 pdf(Metal& metal, const Hit& hit, const vec3& wo, const vec3& wi) {
+  return 0;
+}
+
+vec3 albedo(Metal& metal, const Hit& hit) {
+  return metal.albedo;
+}
+
+//
+// Dielectric
+//
+
+bool sample(Dielectric& dielectric,
+            const camera::Ray& ray,
+            const Hit& hit,
+            BsdfSample& sample) {
   vec3 outwardNormal;
   f32 refractionRatio;
   f32 cosine;
   vec3 refracted;
-  vec3 reflected = reflect(ray.direction, hit.normal);
+  vec3 direction = normalize(ray.direction);
+  vec3 reflected = reflect(direction, hit.normal);
   f32 reflectionProbability = 1;
-  f32 rDotN = dot(normalize(ray.direction), hit.normal);
+  f32 rDotN = dot(direction, hit.normal);
 
   if (rDotN > 0) {
     outwardNormal = -hit.normal;
@@ -45,57 +88,195 @@ bool scatter(Dielectric& dielectric,
     cosine = -rDotN;
   }
 
-  if (refract(ray.direction, outwardNormal, refractionRatio, refracted)) {
+  if (refract(direction, outwardNormal, refractionRatio, refracted)) {
     reflectionProbability = schlick(cosine, dielectric.refractiveIndex);
   }
 
-  if (drand48() < reflectionProbability) {
-    scattered = {hit.p, reflected};
+  if (randomUnit() < reflectionProbability) {
+    sample.direction = reflected;
   } else {
-    scattered = {hit.p, refracted};
+    sample.direction = refracted;
   }
 
-  // TODO(johan): Include albedo in Dialectric material to get colored glass
-  attenuation = vec3(1, 1, 1);
+  sample.weight = texture::value(dielectric.albedo, hit);
+  sample.pdf = 0;
+  sample.specular = true;
 
   return true;
 }
 
+vec3 eval(Dielectric& dielectric,
+          const Hit& hit,
+          const vec3& wo,
+          const vec3& wi) {
+  return vec3(0, 0, 0);
+}
+
+f32 pdf(Dielectric& dielectric,
+        const Hit& hit,
+        const vec3& wo,
+        const vec3& wi) {
+  return 0;
+}
+
+vec3 albedo(Dielectric& dielectric, const Hit& hit) {
+  return texture::value(dielectric.albedo, hit);
+}
+
+//
+// Dispatch
+//
+
+// NOTE(johan): Each material type registers its BSDF in this table, indexed by
+// MaterialType, so callers only need a Material* and adding a material is one
+// new row rather than another case in every switch.
+typedef bool (*SampleFn)(Material* material,
+                         const camera::Ray& ray,
+                         const Hit& hit,
+                         BsdfSample& sample);
+typedef vec3 (*EvalFn)(Material* material,
+                       const Hit& hit,
+                       const vec3& wo,
+                       const vec3& wi);
+typedef f32 (*PdfFn)(Material* material,
+                     const Hit& hit,
+                     const vec3& wo,
+                     const vec3& wi);
+typedef vec3 (*AlbedoFn)(Material* material, const Hit& hit);
+
+// Samples a run of hits which all share the same material type, so the
+// per-type code is called directly instead of through the table each time
+typedef void (*SampleBatchFn)(const camera::Ray* rays,
+                              const Hit* hits,
+                              u32 count,
+                              BsdfSample* samples,
+                              u8* scattered);
+
+struct Bsdf {
+  SampleFn sample;
+  EvalFn eval;
+  PdfFn pdf;
+  AlbedoFn albedo;
+  SampleBatchFn sampleBatch;
+};
+
+#define BSDF_ENTRY(member)                                                    \
+  {[](Material* material, const camera::Ray& ray, const Hit& hit,             \
+      BsdfSample& result) {                                                   \
+     return sample(material->member, ray, hit, result);                       \
+   },                                                                         \
+   [](Material* material, const Hit& hit, const vec3& wo,                     \
+      const vec3& wi) { return eval(material->member, hit, wo, wi); },        \
+   [](Material* material, const Hit& hit, const vec3& wo,                     \
+      const vec3& wi) { return pdf(material->member, hit, wo, wi); },         \
+   [](Material* material, const Hit& hit) {                                   \
+     return albedo(material->member, hit);                                    \
+   },                                                                         \
+   [](const camera::Ray* rays, const Hit* hits, u32 count,                    \
+      BsdfSample* samples, u8* scattered) {                                   \
+     for (u32 i = 0; i < count; i++) {                                        \
+       scattered[i] =                                                         \
+           sample(hits[i].material->member, rays[i], hits[i], samples[i]);    \
+     }                                                                        \
+   }}
+
+const Bsdf bsdfs[] = {
+    BSDF_ENTRY(diffuse),     // MaterialType::Diffuse
+    BSDF_ENTRY(metal),       // MaterialType::Metal
+    BSDF_ENTRY(dielectric),  // MaterialType::Dielectric
+};
+
+#undef BSDF_ENTRY
+
+inline const Bsdf& getBsdf(const Material* material) {
+  return bsdfs[u32(material->type)];
+}
+
+// Samples a scattered direction, wo is implied by the incoming ray
+bool sample(Material* material,
+            const camera::Ray& ray,
+            const Hit& hit,
+            BsdfSample& sample) {
+  return getBsdf(material).sample(material, ray, hit, sample);
+}
+
+// Evaluates f(wo, wi), both directions point away from the hit
+vec3 eval(Material* material, const Hit& hit, const vec3& wo, const vec3& wi) {
+  return getBsdf(material).eval(material, hit, wo, wi);
+}
+
+// Solid angle pdf of sample() generating wi, zero for specular materials
+f32 pdf(Material* material, const Hit& hit, const vec3& wo, const vec3& wi) {
+  return getBsdf(material).pdf(material, hit, wo, wi);
+}
+
+// Overall surface color, used for the albedo AOV and by the denoiser
+vec3 albedo(Material* material, const Hit& hit) {
+  return getBsdf(material).albedo(material, hit);
+}
+
+// Samples count hits, all of which must have a material of the given type
+void sampleBatch(MaterialType type,
+                 const camera::Ray* rays,
+                 const Hit* hits,
+                 u32 count,
+                 BsdfSample* samples,
+                 u8* scattered) {
+  bsdfs[u32(type)].sampleBatch(rays, hits, count, samples, scattered);
+}
+
 bool scatter(Material* material,
              const camera::Ray& ray,
              const Hit& hit,
              vec3& attenuation,
              camera::Ray& rayScatter) {
-  switch (material->type) {
-    case MaterialType::Diffuse:
-      return scatter(material->diffuse, ray, hit, attenuation, rayScatter);
-    case MaterialType::Metal:
-      return scatter(material->metal, ray, hit, attenuation, rayScatter);
-    case MaterialType::Dielectric:
-      return scatter(material->dielectric, ray, hit, attenuation, rayScatter);
-  };
+  BsdfSample bsdfSample;
+  if (!sample(material, ray, hit, bsdfSample))
+    return false;
+  rayScatter = {hit.p, bsdfSample.direction};
+  attenuation = bsdfSample.weight;
+  return true;
 }
 
-Material* createDiffuse(const vec3 albedo) {
+// Every material ever created, indexed by Material::id
+std::vector<Material*> materials;
+
+Material* allocateMaterial(MaterialType type) {
   Material* material = (Material*)malloc(sizeof(Material));
-  material->type = MaterialType::Diffuse;
+  material->type = type;
+  material->id = materials.size();
+  materials.push_back(material);
+  return material;
+}
+
+Material* createDiffuse(texture::Texture* albedo) {
+  Material* material = allocateMaterial(MaterialType::Diffuse);
   material->diffuse.albedo = albedo;
   return material;
 }
 
+Material* createDiffuse(const vec3 albedo) {
+  return createDiffuse(texture::createConstant(albedo));
+}
+
 Material* createMetal(const vec3 albedo, const f32 fuzziness) {
-  Material* material = (Material*)malloc(sizeof(Material));
-  material->type = MaterialType::Metal;
+  Material* material = allocateMaterial(MaterialType::Metal);
   material->metal.albedo = albedo;
   material->metal.fuzziness = clamp(fuzziness);
   return material;
 }
 
-Material* createDielectric(const f32 refractiveIndex) {
-  Material* material = (Material*)malloc(sizeof(Material));
-  material->type = MaterialType::Dielectric;
+Material* createDielectric(const f32 refractiveIndex,
+                           texture::Texture* albedo) {
+  Material* material = allocateMaterial(MaterialType::Dielectric);
   material->dielectric.refractiveIndex = max(1, refractiveIndex);
+  material->dielectric.albedo = albedo;
   return material;
 }
 
+Material* createDielectric(const f32 refractiveIndex) {
+  return createDielectric(refractiveIndex,
+                          texture::createConstant(vec3(1, 1, 1)));
+}
+
 }  // namespace material
\ No newline at end of file
@@ -3,9 +3,16 @@
 namespace material {
 
 enum class MaterialType { Diffuse, Metal, Dielectric };
+const u32 materialTypeCount = 3;
+
+// Sets of material types are masks with one bit per type
+constexpr u32 materialBit(MaterialType type) {
+  return 1u << u32(type);
+}
+const u32 allMaterials = (1u << materialTypeCount) - 1;
 
 struct Diffuse {
-  vec3 albedo;
+  texture::Texture* albedo;
 };
 
 struct Metal {
@@ -15,10 +22,23 @@ struct Metal {
 
 struct Dielectric {
   f32 refractiveIndex;
+  texture::Texture* albedo;
+};
+
+// NOTE(johan): The result of sampling a BSDF. The weight is already
+// f * cos(theta) / pdf so the integrator can multiply it straight into the
+// path throughput. Specular lobes are delta distributions; they have no
+// meaningful eval() or pdf() and can't be picked up by light sampling or MIS.
+struct BsdfSample {
+  vec3 direction;
+  vec3 weight;
+  f32 pdf;
+  bool specular;
 };
 
 struct Material {
   MaterialType type;
+  u32 id;  // Index into materials, for structures that can't afford pointers
   union {
     Diffuse diffuse;
     Metal metal;
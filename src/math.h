@@ -1,6 +1,16 @@
 #pragma once
 
+// NOTE(johan): With SIMD on, vec3 is an SSE register padded to 16 bytes, the
+// fourth lane is zero after construction and ignored by dot(). Each operator
+// is then one instruction instead of three, and copies are one aligned move.
+// There's deliberately no vec4: nothing in the renderer works in four
+// components (colours have no alpha, there are no homogeneous transforms), and
+// the padded vec3 already fills the whole register.
+#if USE_SIMD
+struct alignas(16) vec3 {
+#else
 struct vec3 {
+#endif
   union {
     struct {
       f32 x, y, z;
@@ -9,21 +19,65 @@ struct vec3 {
       f32 r, g, b;
     };
     f32 e[3];
+#if USE_SIMD
+    __m128 m;
+#endif
   };
 
+#if USE_SIMD
+  // Zeroed, so a vec3 filled in one axis at a time has a clean fourth lane
+  vec3() { m = _mm_setzero_ps(); }
+  vec3(f32 e0, f32 e1, f32 e2) { m = _mm_set_ps(0, e2, e1, e0); }
+  explicit vec3(__m128 _m) { m = _m; }
+#else
   vec3() {}
-
   vec3(f32 e0, f32 e1, f32 e2) {
     e[0] = e0;
     e[1] = e1;
     e[2] = e2;
   }
+#endif
 
   inline const vec3& operator+() { return *this; }
-  inline vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
   inline f32 operator[](u32 i) const { return e[i]; }
   inline f32& operator[](u32 i) { return e[i]; }
 
+#if USE_SIMD
+  inline vec3 operator-() const {
+    return vec3(_mm_sub_ps(_mm_setzero_ps(), m));
+  }
+
+  inline vec3& operator+=(const vec3& v2) {
+    m = _mm_add_ps(m, v2.m);
+    return *this;
+  }
+  inline vec3& operator-=(const vec3& v2) {
+    m = _mm_sub_ps(m, v2.m);
+    return *this;
+  }
+
+  inline vec3& operator*=(const vec3& v2) {
+    m = _mm_mul_ps(m, v2.m);
+    return *this;
+  }
+
+  inline vec3& operator/=(const vec3& v2) {
+    m = _mm_div_ps(m, v2.m);
+    return *this;
+  }
+
+  inline vec3& operator*=(const f32 t) {
+    m = _mm_mul_ps(m, _mm_set1_ps(t));
+    return *this;
+  }
+
+  inline vec3& operator/=(const f32 t) {
+    m = _mm_div_ps(m, _mm_set1_ps(t));
+    return *this;
+  }
+#else
+  inline vec3 operator-() const { return vec3(-e[0], -e[1], -e[2]); }
+
   inline vec3& operator+=(const vec3& v2) {
     this->e[0] += v2.e[0];
     this->e[1] += v2.e[1];
@@ -64,12 +118,10 @@ struct vec3 {
     this->e[2] /= t;
     return *this;
   }
+#endif
 
-  inline f32 length() const {
-    return sqrt(e[0] * e[0] + e[1] * e[1] + e[2] * e[2]);
-  }
-
-  inline f32 length2() const { return e[0] * e[0] + e[1] * e[1] + e[2] * e[2]; }
+  inline f32 length() const { return sqrt(length2()); }
+  inline f32 length2() const;
 };
 
 // inline std::istream& operator>>(std::istream& is, const vec3& v) {
@@ -82,6 +134,99 @@ inline std::ostream& operator<<(std::ostream& os, const vec3& v) {
   return os;
 }
 
+//
+// Fast reciprocals
+//
+
+// NOTE(johan): The SSE estimates are only good to about 12 bits, one
+// Newton-Raphson step brings them to within a couple of ulps of the exact
+// result, still well ahead of a divide or a sqrt and divide.
+inline f32 reciprocal(f32 x) {
+#if USE_SIMD
+  __m128 v = _mm_set_ss(x);
+  __m128 y = _mm_rcp_ss(v);
+  // y' = y * (2 - x * y)
+  y = _mm_mul_ss(y, _mm_sub_ss(_mm_set_ss(2), _mm_mul_ss(v, y)));
+  return _mm_cvtss_f32(y);
+#else
+  return 1 / x;
+#endif
+}
+
+inline f32 rsqrt(f32 x) {
+#if USE_SIMD
+  __m128 v = _mm_set_ss(x);
+  __m128 y = _mm_rsqrt_ss(v);
+  // y' = y * (1.5 - 0.5 * x * y * y)
+  __m128 halfXyy =
+      _mm_mul_ss(_mm_mul_ss(_mm_set_ss(0.5f), v), _mm_mul_ss(y, y));
+  y = _mm_mul_ss(y, _mm_sub_ss(_mm_set_ss(1.5f), halfXyy));
+  return _mm_cvtss_f32(y);
+#else
+  return 1 / sqrt(x);
+#endif
+}
+
+// x^n by repeated squaring, for a constant n the loop folds away entirely
+inline f32 powi(f32 x, u32 n) {
+  f32 result = 1;
+  while (n) {
+    if (n & 1)
+      result *= x;
+    x *= x;
+    n >>= 1;
+  }
+  return result;
+}
+
+#if USE_SIMD
+
+inline vec3 operator+(const vec3& v1, const vec3& v2) {
+  return vec3(_mm_add_ps(v1.m, v2.m));
+}
+
+inline vec3 operator-(const vec3& v1, const vec3& v2) {
+  return vec3(_mm_sub_ps(v1.m, v2.m));
+}
+
+inline vec3 operator*(const vec3& v1, const vec3& v2) {
+  return vec3(_mm_mul_ps(v1.m, v2.m));
+}
+
+inline vec3 operator/(const vec3& v1, const vec3& v2) {
+  return vec3(_mm_div_ps(v1.m, v2.m));
+}
+
+inline vec3 operator*(const f32 t, const vec3& v) {
+  return vec3(_mm_mul_ps(_mm_set1_ps(t), v.m));
+}
+
+inline vec3 operator*(const vec3& v, const f32 t) {
+  return vec3(_mm_mul_ps(v.m, _mm_set1_ps(t)));
+}
+
+inline vec3 operator/(const vec3& v, const f32 t) {
+  return vec3(_mm_div_ps(v.m, _mm_set1_ps(t)));
+}
+
+inline f32 dot(const vec3& v1, const vec3& v2) {
+  __m128 p = _mm_mul_ps(v1.m, v2.m);
+  __m128 y = _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1));
+  __m128 z = _mm_shuffle_ps(p, p, _MM_SHUFFLE(2, 2, 2, 2));
+  return _mm_cvtss_f32(_mm_add_ss(_mm_add_ss(p, y), z));
+}
+
+inline vec3 cross(const vec3& v1, const vec3& v2) {
+  // v1.yzx * v2.zxy - v1.zxy * v2.yzx
+  __m128 a = _mm_shuffle_ps(v1.m, v1.m, _MM_SHUFFLE(3, 0, 2, 1));
+  __m128 b = _mm_shuffle_ps(v2.m, v2.m, _MM_SHUFFLE(3, 1, 0, 2));
+  __m128 c = _mm_shuffle_ps(v1.m, v1.m, _MM_SHUFFLE(3, 1, 0, 2));
+  __m128 d = _mm_shuffle_ps(v2.m, v2.m, _MM_SHUFFLE(3, 0, 2, 1));
+  return vec3(_mm_sub_ps(_mm_mul_ps(a, b), _mm_mul_ps(c, d)));
+}
+
+#else
+
 inline vec3 operator+(const vec3& v1, const vec3& v2) {
   return vec3(v1.e[0] + v2.e[0], v1.e[1] + v2.e[1], v1.e[2] + v2.e[2]);
 }
@@ -110,11 +255,6 @@ inline vec3 operator/(const vec3& v, const f32 t) {
   return vec3(v.e[0] / t, v.e[1] / t, v.e[2] / t);
 }
 
-inline vec3 normalize(const vec3& v) {
-  f32 k = 1.0f / v.length();
-  return vec3(v.e[0] * k, v.e[1] * k, v.e[2] * k);
-}
-
 inline f32 dot(const vec3& v1, const vec3& v2) {
   return v1.e[0] * v2.e[0] + v1.e[1] * v2.e[1] + v1.e[2] * v2.e[2];
 }
@@ -125,6 +265,37 @@ inline vec3 cross(const vec3& v1, const vec3& v2) {
               v1.e[0] * v2.e[1] - v1.e[1] * v2.e[0]);
 }
 
+#endif
+
+inline f32 vec3::length2() const {
+  return dot(*this, *this);
+}
+
+#if USE_SIMD
+
+// Same as rsqrt(), on the squared length broadcast to all four lanes so the
+// result never leaves the register
+inline vec3 normalize(const vec3& v) {
+  __m128 p = _mm_mul_ps(v.m, v.m);
+  __m128 length2 =
+      _mm_add_ps(_mm_add_ps(_mm_shuffle_ps(p, p, _MM_SHUFFLE(0, 0, 0, 0)),
+                            _mm_shuffle_ps(p, p, _MM_SHUFFLE(1, 1, 1, 1))),
+                 _mm_shuffle_ps(p, p, _MM_SHUFFLE(2, 2, 2, 2)));
+  __m128 y = _mm_rsqrt_ps(length2);
+  __m128 halfXyy =
+      _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), length2), _mm_mul_ps(y, y));
+  y = _mm_mul_ps(y, _mm_sub_ps(_mm_set1_ps(1.5f), halfXyy));
+  return vec3(_mm_mul_ps(v.m, y));
+}
+
+#else
+
+inline vec3 normalize(const vec3& v) {
+  return v * rsqrt(v.length2());
+}
+
+#endif
+
 inline vec3 lerp(const vec3& v1, const vec3& v2, f32 t) {
   return (1 - t) * v1 + t * v2;
 }
@@ -141,21 +312,74 @@ inline f32 clamp(f32 t) {
   return max(min(t, 1), 0);
 }
 
+inline f32 luminance(const vec3& color) {
+  return 0.2126f * color.r + 0.7152f * color.g + 0.0722f * color.b;
+}
+
+// NOTE(johan): drand48() keeps one global state and isn't safe to call from
+// the render threads, so rendering uses a per-thread xorshift generator. Each
+// render thread seeds its own state before it starts tracing.
+thread_local u64 randomState = 0x9e3779b97f4a7c15ull;
+
+inline void seedRandom(u64 seed) {
+  // splitmix64, so nearby seeds still give unrelated states
+  u64 z = seed + 0x9e3779b97f4a7c15ull;
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  randomState = (z ^ (z >> 31)) | 1;
+}
+
+// Uniform in [0, 1)
+inline f32 randomUnit() {
+  randomState ^= randomState << 13;
+  randomState ^= randomState >> 7;
+  randomState ^= randomState << 17;
+  return (randomState >> 40) * (1.0f / 16777216.0f);
+}
+
 vec3 randomPointInUnitSphere() {
   vec3 result;
 
   do {
-    result = 2.0f * vec3(drand48(), drand48(), drand48()) - vec3(1, 1, 1);
+    result = 2.0f * vec3(randomUnit(), randomUnit(), randomUnit()) -
+             vec3(1, 1, 1);
   } while (result.length2() >= 1.0f);
 
   return result;
 }
 
+// NOTE(johan): Malley's method, a uniform point on the disk projected up onto
+// the hemisphere gives a cosine-weighted direction around +z without the
+// rejection loop.
+vec3 randomCosineDirection() {
+  f32 r1 = randomUnit();
+  f32 r2 = randomUnit();
+  f32 phi = 2 * M_PI * r1;
+  f32 r = sqrt(r2);
+  return vec3(r * cos(phi), r * sin(phi), sqrt(1 - r2));
+}
+
+// Builds an orthonormal basis around a unit normal (Duff et al. 2017)
+void makeBasis(const vec3& normal, vec3& tangent, vec3& bitangent) {
+  f32 sign = copysignf(1.0f, normal.z);
+  f32 a = -1.0f / (sign + normal.z);
+  f32 b = normal.x * normal.y * a;
+  tangent = vec3(1 + sign * normal.x * normal.x * a, sign * b,
+                 -sign * normal.x);
+  bitangent = vec3(b, sign + normal.y * normal.y * a, -normal.y);
+}
+
+inline vec3 toWorld(const vec3& local, const vec3& normal) {
+  vec3 tangent, bitangent;
+  makeBasis(normal, tangent, bitangent);
+  return local.x * tangent + local.y * bitangent + local.z * normal;
+}
+
 vec3 randomPointInUnitDisk() {
   vec3 result;
 
   do {
-    result = 2.0f * vec3(drand48(), drand48(), 0) - vec3(1, 1, 0);
+    result = 2.0f * vec3(randomUnit(), randomUnit(), 0) - vec3(1, 1, 0);
   } while (result.length2() >= 1.0f);
 
   return result;
@@ -165,11 +389,11 @@ vec3 reflect(const vec3& v, const vec3& normal) {
   return v - 2 * dot(v, normal) * normal;
 }
 
-bool refract(const vec3& v,
+// v must be normalized
+bool refract(const vec3& uv,
              const vec3& normal,
              const f32 refractionRatio,
              vec3& refracted) {
-  vec3 uv = normalize(v);
   float dt = dot(uv, normal);
   float discriminant = 1 - refractionRatio * refractionRatio * (1 - dt * dt);
 
@@ -185,5 +409,5 @@ bool refract(const vec3& v,
 f32 schlick(f32 cosine, f32 refractiveIndex) {
   f32 r0 = (1 - refractiveIndex) / (1 + refractiveIndex);
   r0 *= r0;
-  return r0 + (1 - r0) * pow(1 - cosine, 5);
+  return r0 + (1 - r0) * powi(1 - cosine, 5);
 }
\ No newline at end of file
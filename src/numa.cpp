@@ -0,0 +1,180 @@
+namespace numa {
+
+// The node the calling thread was pinned to, zero if it never was
+thread_local u32 threadNode = 0;
+
+// Parses a sysfs list like "0-3,8-11"
+std::vector<u32> parseList(const std::string& list) {
+  std::vector<u32> values;
+  const char* at = list.c_str();
+  while (isdigit(*at)) {
+    char* end;
+    u32 first = strtoul(at, &end, 10);
+    u32 last = first;
+    if (*end == '-') {
+      last = strtoul(end + 1, &end, 10);
+    }
+    for (u32 value = first; value <= last; value++) {
+      values.push_back(value);
+    }
+    at = *end == ',' ? end + 1 : end;
+  }
+  return values;
+}
+
+std::string nodePath(u32 nodeId, const char* file) {
+  return "/sys/devices/system/node/node" + std::to_string(nodeId) + "/" + file;
+}
+
+std::string readLine(const std::string& path) {
+  std::ifstream file(path);
+  std::string line;
+  std::getline(file, line);
+  return line;
+}
+
+// Works out the placement of threadCount threads. Without NUMA (or off
+// Linux) everything is on one node and threads aren't pinned at all.
+Placement* createPlacement(u32 threadCount) {
+  Placement* placement = new Placement();
+
+#ifdef __linux__
+  // Only CPUs this process is allowed on, which taskset or a container may
+  // have narrowed down
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  sched_getaffinity(0, sizeof(allowed), &allowed);
+
+  for (u32 nodeId :
+       parseList(readLine("/sys/devices/system/node/online"))) {
+    std::vector<u32> cpus;
+    for (u32 cpu : parseList(readLine(nodePath(nodeId, "cpulist")))) {
+      if (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)) {
+        cpus.push_back(cpu);
+      }
+    }
+    if (!cpus.empty() && placement->nodeIds.size() < maxNodes) {
+      placement->nodeIds.push_back(nodeId);
+      placement->nodeCpus.push_back(cpus);
+    }
+  }
+#endif
+
+  if (placement->nodeIds.empty()) {
+    placement->nodeIds.push_back(0);
+    placement->nodeCpus.push_back({});
+  }
+  placement->nodeCount = placement->nodeIds.size();
+
+  for (u32 i = 0; i < threadCount; i++) {
+    u32 node = i % placement->nodeCount;
+    const std::vector<u32>& cpus = placement->nodeCpus[node];
+    placement->threadNodes.push_back(node);
+    placement->threadCpus.push_back(
+        cpus.empty() ? 0 : cpus[(i / placement->nodeCount) % cpus.size()]);
+  }
+  return placement;
+}
+
+void pinToCpus(const std::vector<u32>& cpus) {
+#ifdef __linux__
+  if (cpus.empty())
+    return;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (u32 cpu : cpus) {
+    CPU_SET(cpu, &set);
+  }
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+// Pins the calling thread to the CPU for render thread threadIndex
+void pinThread(const Placement* placement, u32 threadIndex) {
+  u32 i = threadIndex % placement->threadNodes.size();
+  threadNode = placement->threadNodes[i];
+  if (!placement->nodeCpus[threadNode].empty()) {
+    pinToCpus({placement->threadCpus[i]});
+  }
+}
+
+// Runs work on a thread pinned to node (to any of its CPUs), so that the
+// memory it allocates and touches first ends up on that node
+void runOnNode(const Placement* placement,
+               u32 node,
+               const std::function<void()>& work) {
+  std::thread thread([placement, node, &work] {
+    threadNode = node;
+    pinToCpus(placement->nodeCpus[node]);
+    work();
+  });
+  thread.join();
+}
+
+// Moves the whole pages in [start, start + bytes) to node and keeps them
+// there. Returns false if the kernel won't, as it may not in a container.
+bool bindMemory(const Placement* placement,
+                const void* start,
+                u64 bytes,
+                u32 node) {
+#ifdef __linux__
+  u64 pageSize = sysconf(_SC_PAGESIZE);
+  u64 begin = (u64(start) + pageSize - 1) & ~(pageSize - 1);
+  u64 end = (u64(start) + bytes) & ~(pageSize - 1);
+  if (end <= begin)
+    return true;
+
+  u32 nodeId = placement->nodeIds[node];
+  // Sized from the id, which can be well past nodeCount on sparse machines
+  std::vector<u64> mask(nodeId / 64 + 1);
+  mask[nodeId / 64] |= 1ull << (nodeId % 64);
+  return syscall(SYS_mbind, begin, end - begin, MPOL_BIND, mask.data(),
+                 mask.size() * 64 + 1, MPOL_MF_MOVE) == 0;
+#else
+  return true;
+#endif
+}
+
+// NOTE(johan): These count pages allocated, not memory accesses, so they show
+// whether the data landed where the threads using it run but not how much
+// traffic crossed between sockets. That needs the uncore performance
+// counters, e.g. from perf stat, which aren't read here.
+std::vector<NodeCounters> readCounters(const Placement* placement) {
+  std::vector<NodeCounters> counters(placement->nodeCount);
+  for (u32 node = 0; node < placement->nodeCount; node++) {
+    NodeCounters& nodeCounters = counters[node];
+    nodeCounters = {0, 0, 0};
+
+    std::ifstream file(nodePath(placement->nodeIds[node], "numastat"));
+    std::string name;
+    u64 value;
+    while (file >> name >> value) {
+      if (name == "local_node") {
+        nodeCounters.local = value;
+      } else if (name == "other_node") {
+        nodeCounters.remote = value;
+      } else if (name == "numa_miss") {
+        nodeCounters.miss = value;
+      }
+    }
+  }
+  return counters;
+}
+
+// Prints how each node's counters changed between before and after
+void printCounters(const Placement* placement,
+                   const std::vector<NodeCounters>& before,
+                   const std::vector<NodeCounters>& after) {
+  for (u32 node = 0; node < placement->nodeCount; node++) {
+    u32 threads = std::count(placement->threadNodes.begin(),
+                             placement->threadNodes.end(), node);
+    const NodeCounters& start = before[node];
+    const NodeCounters& end = after[node];
+    std::cerr << "Node " << placement->nodeIds[node] << ": " << threads
+              << " threads, pages allocated " << end.local - start.local
+              << " local, " << end.remote - start.remote << " remote, "
+              << end.miss - start.miss << " missed\n";
+  }
+}
+
+}  // namespace numa
@@ -0,0 +1,25 @@
+namespace numa {
+
+// Most nodes placed over, any more are left unused
+const u32 maxNodes = 64;
+
+// NOTE(johan): Where each render thread runs. Threads are spread over the
+// nodes round robin, so even a few threads get every node's memory bandwidth,
+// and fill the CPUs within each node in order. Nodes are numbered by their
+// position here, nodeIds has what the kernel calls them.
+struct Placement {
+  u32 nodeCount;
+  std::vector<u32> nodeIds;
+  std::vector<std::vector<u32>> nodeCpus;
+  std::vector<u32> threadNodes;
+  std::vector<u32> threadCpus;
+};
+
+// Page allocation counters for a node, from its numastat
+struct NodeCounters {
+  u64 local;   // For threads running on this node
+  u64 remote;  // For threads running on other nodes
+  u64 miss;    // Meant for another node that was out of memory
+};
+
+}  // namespace numa
@@ -0,0 +1,492 @@
+namespace paging {
+
+// Every chunk file starts with this, followed by its nodes and then its
+// spheres, both exactly as bvh::CompactBvh<u16> has them in memory
+struct ChunkHeader {
+  u32 magic;
+  u32 nodeCount;
+  u32 sphereCount;
+  f32 boxMin[3];
+  f32 boxMax[3];
+};
+
+// The index lists every chunk's box and file size, in chunk order
+struct IndexEntry {
+  f32 boxMin[3];
+  f32 boxMax[3];
+  u64 bytes;
+};
+
+const u32 chunkMagic = 0x6b6e6863;  // "chnk"
+
+std::string chunkPath(const std::string& directory, u32 index) {
+  return directory + "/chunk" + std::to_string(index) + ".bin";
+}
+
+std::string indexPath(const std::string& directory) {
+  return directory + "/index.bin";
+}
+
+//
+// Writing
+//
+
+// Cuts the tree into subtrees of at most maxChunkEntities, largest first
+void collectChunks(const bvh::BoundingVolume* volume,
+                   u32 maxChunkEntities,
+                   std::vector<const bvh::BoundingVolume*>& chunks) {
+  if (!volume)
+    return;
+  if (bvh::countEntities(volume) <= maxChunkEntities ||
+      (!volume->left && !volume->right)) {
+    chunks.push_back(volume);
+    return;
+  }
+  collectChunks(volume->left, maxChunkEntities, chunks);
+  collectChunks(volume->right, maxChunkEntities, chunks);
+}
+
+// NOTE(johan): Splits a BVH into chunks of at most maxChunkEntities spheres
+// along its own subtrees, which keeps each chunk spatially coherent, and
+// writes each one out as a compact BVH. Spatial splits can put a sphere in
+// more than one subtree, in which case it's in more than one chunk too.
+// Returns how many chunks were written.
+u32 writeChunks(const bvh::BoundingVolume* root,
+                 const std::string& directory,
+                 u32 maxChunkEntities) {
+  mkdir(directory.c_str(), 0755);
+
+  std::vector<const bvh::BoundingVolume*> subtrees;
+  collectChunks(root, maxChunkEntities, subtrees);
+
+  std::vector<IndexEntry> index;
+  for (u32 i = 0; i < subtrees.size(); i++) {
+    bvh::CompactBvh<u16>* compact = bvh::createCompactBvh<u16>(subtrees[i]);
+
+    ChunkHeader header = {chunkMagic,
+                          u32(compact->nodes.size()),
+                          u32(compact->spheres.size()),
+                          {compact->box.minPoint.x, compact->box.minPoint.y,
+                           compact->box.minPoint.z},
+                          {compact->box.maxPoint.x, compact->box.maxPoint.y,
+                           compact->box.maxPoint.z}};
+
+    std::ofstream file(chunkPath(directory, i), std::ios_base::binary);
+    file.write((const char*)&header, sizeof(header));
+    file.write((const char*)compact->nodes.data(),
+               compact->nodes.size() * sizeof(bvh::CompactNode<u16>));
+    file.write((const char*)compact->spheres.data(),
+               compact->spheres.size() * sizeof(bvh::CompactSphere));
+    if (!file) {
+      fatal("Failed to write a chunk");
+    }
+
+    index.push_back({{header.boxMin[0], header.boxMin[1], header.boxMin[2]},
+                     {header.boxMax[0], header.boxMax[1], header.boxMax[2]},
+                     u64(file.tellp())});
+    delete compact;
+  }
+
+  std::ofstream file(indexPath(directory), std::ios_base::binary);
+  file.write((const char*)index.data(), index.size() * sizeof(IndexEntry));
+  if (!file) {
+    fatal("Failed to write the chunk index");
+  }
+  return index.size();
+}
+
+//
+// Reading
+//
+
+inline vec3 center(const bvh::AABB& box) {
+  return 0.5f * (box.minPoint + box.maxPoint);
+}
+
+// Builds the tree over the chunks in order[first, last) at nodeIndex, split
+// in half by their centres along the widest axis
+void buildTree(ChunkedScene* scene,
+               std::vector<u32>& order,
+               u32 first,
+               u32 last,
+               u32 nodeIndex) {
+  bvh::AABB box = scene->chunks[order[first]].box;
+  bvh::AABB centers = bvh::createAABB(center(box), center(box));
+  for (u32 i = first + 1; i < last; i++) {
+    const bvh::AABB& chunkBox = scene->chunks[order[i]].box;
+    box = bvh::surroundingBox(box, chunkBox);
+    centers = bvh::surroundingBox(
+        centers, bvh::createAABB(center(chunkBox), center(chunkBox)));
+  }
+
+  if (last - first == 1) {
+    scene->tree[nodeIndex] = {box, order[first], true};
+    return;
+  }
+
+  vec3 extent = centers.maxPoint - centers.minPoint;
+  u32 axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2)
+                                 : (extent.y > extent.z ? 1 : 2);
+  u32 middle = (first + last) / 2;
+  std::nth_element(order.begin() + first, order.begin() + middle,
+                   order.begin() + last, [scene, axis](u32 a, u32 b) {
+                     return center(scene->chunks[a].box)[axis] <
+                            center(scene->chunks[b].box)[axis];
+                   });
+
+  u32 firstChild = scene->tree.size();
+  scene->tree.resize(firstChild + 2);
+  scene->tree[nodeIndex] = {box, firstChild, false};
+  buildTree(scene, order, first, middle, firstChild);
+  buildTree(scene, order, middle, last, firstChild + 1);
+}
+
+// Opens the chunks written to directory by writeChunks(), without loading
+// any of them yet
+ChunkedScene* openChunks(const std::string& directory, u64 budget) {
+  std::ifstream file(indexPath(directory), std::ios_base::binary);
+  if (!file) {
+    fatal("Failed to open the chunk index");
+  }
+
+  ChunkedScene* scene = new ChunkedScene();
+  scene->budget = budget;
+  scene->residentBytes = 0;
+  scene->peakBytes = 0;
+  scene->clock = 0;
+  scene->loads = 0;
+  scene->evictions = 0;
+
+  IndexEntry entry;
+  while (file.read((char*)&entry, sizeof(entry))) {
+    Chunk chunk;
+    chunk.box = bvh::createAABB(
+        vec3(entry.boxMin[0], entry.boxMin[1], entry.boxMin[2]),
+        vec3(entry.boxMax[0], entry.boxMax[1], entry.boxMax[2]));
+    chunk.path = chunkPath(directory, scene->chunks.size());
+    chunk.bytes = entry.bytes;
+    chunk.mapped = nullptr;
+    chunk.loading = false;
+    chunk.validated = false;
+    chunk.users = 0;
+    chunk.lastUsed = 0;
+    chunk.queuedEntries = 0;
+    scene->chunks.push_back(chunk);
+  }
+
+  if (!scene->chunks.empty()) {
+    std::vector<u32> order(scene->chunks.size());
+    for (u32 i = 0; i < order.size(); i++) {
+      order[i] = i;
+    }
+    scene->tree.resize(1);
+    buildTree(scene, order, 0, order.size(), 0);
+  }
+  return scene;
+}
+
+// NOTE(johan): Checks a mapped chunk is what its header says before anything
+// walks it: that the sizes add up to the file's, every node points inside the
+// file, children come after their parents (so there are no cycles) and every
+// sphere's material exists.
+bool isValidChunk(const u8* data, u64 bytes) {
+  typedef bvh::CompactNode<u16> Node;
+  if (bytes < sizeof(ChunkHeader))
+    return false;
+  const ChunkHeader* header = (const ChunkHeader*)data;
+  if (header->magic != chunkMagic ||
+      bytes != sizeof(ChunkHeader) + u64(header->nodeCount) * sizeof(Node) +
+                   u64(header->sphereCount) * sizeof(bvh::CompactSphere)) {
+    return false;
+  }
+
+  const Node* nodes = (const Node*)(data + sizeof(ChunkHeader));
+  const bvh::CompactSphere* spheres =
+      (const bvh::CompactSphere*)(nodes + header->nodeCount);
+  for (u32 i = 0; i < header->nodeCount; i++) {
+    const Node& node = nodes[i];
+    if (node.count) {
+      if (u64(node.index) + node.count > header->sphereCount)
+        return false;
+    } else {
+      if (node.index <= i || u64(node.index) + 2 > header->nodeCount)
+        return false;
+    }
+  }
+  for (u32 i = 0; i < header->sphereCount; i++) {
+    if (spheres[i].materialId >= material::materials.size())
+      return false;
+  }
+  return true;
+}
+
+// Unmaps the least recently used chunks nobody is using until bytes more
+// would fit in the budget, or there's nothing left to unmap. Call with the
+// mutex held.
+void makeRoom(ChunkedScene* scene, u64 bytes) {
+  while (scene->residentBytes + bytes > scene->budget) {
+    Chunk* oldest = nullptr;
+    for (auto& chunk : scene->chunks) {
+      if (chunk.mapped && !chunk.users &&
+          (!oldest || chunk.lastUsed < oldest->lastUsed)) {
+        oldest = &chunk;
+      }
+    }
+    if (!oldest)
+      return;
+
+    munmap((void*)oldest->mapped, oldest->bytes);
+    oldest->mapped = nullptr;
+    scene->residentBytes -= oldest->bytes;
+    scene->evictions++;
+  }
+}
+
+// Maps a chunk's file in, checking it with isValidChunk() if validate is set.
+// Doesn't touch the scene, so it's called without the mutex.
+const u8* mapChunk(const Chunk& chunk, bool validate) {
+  s32 file = open(chunk.path.c_str(), O_RDONLY);
+  if (file < 0) {
+    fatal("Failed to open a chunk");
+  }
+  // NOTE(johan): A file shorter than the mapping would fault when the
+  // missing pages are touched, rather than failing here
+  struct stat info;
+  if (fstat(file, &info) != 0 || u64(info.st_size) != chunk.bytes) {
+    fatal("Chunk file doesn't match the index");
+  }
+  void* mapped = mmap(nullptr, chunk.bytes, PROT_READ, MAP_PRIVATE, file, 0);
+  close(file);
+  if (mapped == MAP_FAILED) {
+    fatal("Failed to map a chunk");
+  }
+  // Validating and then every ray queued for it walk the whole thing, so
+  // read it all in now rather than a page fault at a time
+  madvise(mapped, chunk.bytes, MADV_WILLNEED);
+  if (validate && !isValidChunk((const u8*)mapped, chunk.bytes)) {
+    fatal("Chunk file is corrupt");
+  }
+  return (const u8*)mapped;
+}
+
+// NOTE(johan): Maps the chunk in if it isn't already and keeps it there until
+// release(). Call with the mutex held in lock. The mutex is dropped while the
+// file is read, so one thread's load doesn't stall everyone else's queueing
+// and testing, and anyone else wanting the chunk meanwhile waits for it. Its
+// bytes count as resident from the start so the budget covers loads still in
+// flight.
+bvh::CompactBvhView<u16> acquire(ChunkedScene* scene,
+                                 u32 index,
+                                 std::unique_lock<std::mutex>& lock) {
+  Chunk& chunk = scene->chunks[index];
+  chunk.users++;
+
+  while (chunk.loading) {
+    scene->chunkLoaded.wait(lock);
+  }
+  if (!chunk.mapped) {
+    makeRoom(scene, chunk.bytes);
+    chunk.loading = true;
+    scene->residentBytes += chunk.bytes;
+    scene->peakBytes = std::max(scene->peakBytes, scene->residentBytes);
+    bool validate = !chunk.validated;
+
+    lock.unlock();
+    const u8* mapped = mapChunk(chunk, validate);
+    lock.lock();
+
+    chunk.mapped = mapped;
+    chunk.loading = false;
+    chunk.validated = true;
+    scene->loads++;
+    scene->chunkLoaded.notify_all();
+  }
+
+  const ChunkHeader* header = (const ChunkHeader*)chunk.mapped;
+  const u8* nodes = chunk.mapped + sizeof(ChunkHeader);
+  const u8* spheres =
+      nodes + header->nodeCount * sizeof(bvh::CompactNode<u16>);
+  return {chunk.box, (const bvh::CompactNode<u16>*)nodes, header->nodeCount,
+          (const bvh::CompactSphere*)spheres};
+}
+
+// Call with the mutex held
+void release(ChunkedScene* scene, u32 index) {
+  Chunk& chunk = scene->chunks[index];
+  chunk.users--;
+  chunk.lastUsed = ++scene->clock;
+}
+
+// NOTE(johan): One thread's rays in findHits(). Whichever thread tests them
+// against a chunk holds mutex while it updates the results, since another
+// thread may be testing the same rays against another chunk at the time.
+struct RayBatch {
+  const camera::Ray* rays;
+  f32 tMin;
+  Hit* hits;
+  u8* found;
+  f32* closest;
+  std::mutex mutex;
+  u32 pending;  // Queued rays not tested yet, guarded by the scene's mutex
+};
+
+// Adds every chunk the ray passes through to queues, with the distance it
+// enters each one at
+void queueRay(const ChunkedScene* scene,
+              RayBatch* batch,
+              u32 rayIndex,
+              RayQueues& queues) {
+  if (scene->tree.empty())
+    return;
+
+  const camera::Ray& ray = batch->rays[rayIndex];
+  vec3 inverseDirection(1 / ray.direction.x, 1 / ray.direction.y,
+                        1 / ray.direction.z);
+  u32 stack[64];
+  u32 stackSize = 0;
+  stack[stackSize++] = 0;
+  while (stackSize) {
+    const ChunkNode& node = scene->tree[stack[--stackSize]];
+    f32 entry;
+    if (!bvh::findHit(node.box, ray, inverseDirection, batch->tMin, FLT_MAX,
+                      entry)) {
+      continue;
+    }
+    if (node.leaf) {
+      queues.chunks.push_back(node.index);
+      queues.queued.push_back({batch, rayIndex, entry});
+    } else {
+      stack[stackSize++] = node.index;
+      stack[stackSize++] = node.index + 1;
+    }
+  }
+}
+
+// NOTE(johan): The next chunk to test, or -1 if nothing is queued. Resident
+// chunks go first, so they aren't evicted to make room for others before
+// being used. Then the ones rays enter soonest on average, since a ray that
+// hits something there can skip every chunk it only enters further on. Call
+// with the mutex held.
+u32 nextChunk(const ChunkedScene* scene) {
+  u32 best = u32(-1);
+  f32 bestEntry = 0;
+  bool bestResident = false;
+  for (u32 i = 0; i < scene->chunks.size(); i++) {
+    const Chunk& chunk = scene->chunks[i];
+    if (chunk.queue.empty())
+      continue;
+    bool resident = chunk.mapped != nullptr;
+    f32 entry = chunk.queuedEntries / chunk.queue.size();
+    if (best == u32(-1) || (resident && !bestResident) ||
+        (resident == bestResident && entry < bestEntry)) {
+      best = i;
+      bestEntry = entry;
+      bestResident = resident;
+    }
+  }
+  return best;
+}
+
+// Tests a chunk's claimed rays against it. Each thread queues all its rays
+// at once, so they come grouped by batch.
+void testRays(const bvh::CompactBvhView<u16>& view,
+              const std::vector<QueuedRay>& claimed) {
+  for (u32 first = 0; first < claimed.size();) {
+    RayBatch* batch = claimed[first].batch;
+    u32 last = first;
+    std::lock_guard<std::mutex> lock(batch->mutex);
+    for (; last < claimed.size() && claimed[last].batch == batch; last++) {
+      const QueuedRay& queued = claimed[last];
+      f32& closest = batch->closest[queued.ray];
+      if (queued.entry >= closest)
+        continue;
+      Hit hit;
+      if (bvh::findHit(view, batch->rays[queued.ray], batch->tMin, closest,
+                       hit)) {
+        batch->hits[queued.ray] = hit;
+        batch->found[queued.ray] = 1;
+        closest = hit.t;
+      }
+    }
+    first = last;
+  }
+}
+
+// NOTE(johan): The closest hit for each of a batch of rays. Rather than
+// following each ray through the chunks, which could need a different chunk
+// loaded for every ray, rays are queued on every chunk whose box they pass
+// through, found with the tree over the chunk boxes. The queues are shared by
+// all the threads: a thread takes a chunk's whole queue, whoever's rays are in
+// it, loads the chunk once and tests them all. It keeps doing that until its
+// own rays have all been tested, by it or anyone else, so threads tracing
+// the same bounce at once share each load.
+void findHits(ChunkedScene* scene,
+              const std::vector<camera::Ray>& rays,
+              f32 tMin,
+              RayQueues& queues,
+              std::vector<Hit>& hits,
+              std::vector<u8>& found) {
+  queues.closest.assign(rays.size(), FLT_MAX);
+  hits.resize(rays.size());
+  found.assign(rays.size(), 0);
+
+  RayBatch batch;
+  batch.rays = rays.data();
+  batch.tMin = tMin;
+  batch.hits = hits.data();
+  batch.found = found.data();
+  batch.closest = queues.closest.data();
+
+  queues.chunks.clear();
+  queues.queued.clear();
+  for (u32 i = 0; i < rays.size(); i++) {
+    queueRay(scene, &batch, i, queues);
+  }
+
+  std::unique_lock<std::mutex> lock(scene->mutex);
+  batch.pending = queues.queued.size();
+  for (u32 i = 0; i < queues.queued.size(); i++) {
+    Chunk& chunk = scene->chunks[queues.chunks[i]];
+    chunk.queue.push_back(queues.queued[i]);
+    chunk.queuedEntries += queues.queued[i].entry;
+  }
+
+  while (batch.pending) {
+    u32 index = nextChunk(scene);
+    if (index == u32(-1)) {
+      // Someone else has the rest of our rays
+      scene->batchDone.wait(lock);
+      continue;
+    }
+
+    Chunk& chunk = scene->chunks[index];
+    queues.claimed.clear();
+    queues.claimed.swap(chunk.queue);
+    chunk.queuedEntries = 0;
+    bvh::CompactBvhView<u16> view = acquire(scene, index, lock);
+    lock.unlock();
+
+    testRays(view, queues.claimed);
+
+    lock.lock();
+    release(scene, index);
+    bool finished = false;
+    for (auto& queued : queues.claimed) {
+      if (--queued.batch->pending == 0) {
+        finished = true;
+      }
+    }
+    if (finished) {
+      scene->batchDone.notify_all();
+    }
+  }
+}
+
+void printStats(ChunkedScene* scene) {
+  std::lock_guard<std::mutex> lock(scene->mutex);
+  std::cerr << "Chunks: " << scene->loads << " loads, " << scene->evictions
+            << " evictions, peak " << scene->peakBytes << " of "
+            << scene->budget << " bytes mapped\n";
+}
+
+}  // namespace paging
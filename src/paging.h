@@ -0,0 +1,66 @@
+namespace paging {
+
+struct RayBatch;  // See paging.cpp
+
+// A ray waiting to be tested against a chunk, from any thread's batch
+struct QueuedRay {
+  RayBatch* batch;
+  u32 ray;
+  f32 entry;  // Where the ray enters the chunk's box
+};
+
+// NOTE(johan): One spatially coherent piece of an out-of-core scene, a
+// compact BVH over its spheres in a file of its own. Only the box and where
+// to find the file are kept in memory, the file itself is mapped in while
+// rays are being tested against it and may be unmapped again whenever nobody
+// is using it.
+struct Chunk {
+  bvh::AABB box;
+  std::string path;
+  u64 bytes;
+
+  // Guarded by the scene's mutex
+  const u8* mapped;  // Null unless resident
+  bool loading;      // Being mapped in by a thread without the mutex
+  bool validated;    // Checked once already, so remapping can skip it
+  u32 users;         // Threads testing rays against it, or waiting to
+  u64 lastUsed;      // When it was last released, for evicting the oldest
+  std::vector<QueuedRay> queue;  // Rays from every thread waiting on it
+  f32 queuedEntries;             // Sum of their entry distances
+};
+
+// A node of the BVH over the chunks' boxes, each leaf is one chunk
+struct ChunkNode {
+  bvh::AABB box;
+  u32 index;  // First child for interior nodes, the chunk for leaves
+  bool leaf;
+};
+
+// NOTE(johan): A scene split into chunks that are paged in on demand, keeping
+// at most budget bytes mapped. Chunks still in use are never evicted, so the
+// budget is exceeded rather than stalling if every resident chunk is busy,
+// and it needs to allow for a chunk per render thread to be kept to.
+struct ChunkedScene {
+  std::vector<Chunk> chunks;
+  std::vector<ChunkNode> tree;
+  u64 budget;
+
+  std::mutex mutex;
+  std::condition_variable batchDone;    // Some thread's rays are all tested
+  std::condition_variable chunkLoaded;  // Some chunk finished loading
+  u64 residentBytes;
+  u64 peakBytes;
+  u64 clock;  // Counts releases, stamps lastUsed
+  u64 loads;
+  u64 evictions;
+};
+
+// Per thread scratch for findHits(), reused between batches
+struct RayQueues {
+  std::vector<u32> chunks;         // The chunk for each of queued
+  std::vector<QueuedRay> queued;   // Before they're added to the chunks
+  std::vector<QueuedRay> claimed;  // Taken from a chunk to test
+  std::vector<f32> closest;        // Per ray
+};
+
+}  // namespace paging
@@ -0,0 +1,348 @@
+namespace preview {
+
+//
+// PNG encoding
+//
+
+// NOTE(johan): Frames only ever travel over localhost, so the PNG uses stored
+// (uncompressed) deflate blocks, which need no compressor at all.
+struct CrcTable {
+  u32 entries[256];
+
+  CrcTable() {
+    for (u32 i = 0; i < 256; i++) {
+      u32 c = i;
+      for (u32 k = 0; k < 8; k++) {
+        c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      }
+      entries[i] = c;
+    }
+  }
+};
+
+u32 crc32(const u8* data, u32 length, u32 crc = 0) {
+  // Built by whichever thread gets here first, the others wait for it
+  static const CrcTable table;
+
+  crc = ~crc;
+  for (u32 i = 0; i < length; i++) {
+    crc = table.entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+u32 adler32(const u8* data, u32 length) {
+  u32 a = 1;
+  u32 b = 0;
+  for (u32 i = 0; i < length; i++) {
+    a = (a + data[i]) % 65521;
+    b = (b + a) % 65521;
+  }
+  return (b << 16) | a;
+}
+
+void appendBigEndian(std::string& out, u32 value) {
+  out.push_back(char(value >> 24));
+  out.push_back(char(value >> 16));
+  out.push_back(char(value >> 8));
+  out.push_back(char(value));
+}
+
+void appendChunk(std::string& png, const char* type, const std::string& data) {
+  appendBigEndian(png, data.size());
+  u32 start = png.size();
+  png.append(type, 4);
+  png.append(data);
+  appendBigEndian(png, crc32((const u8*)&png[start], data.size() + 4));
+}
+
+std::string encodePng(const std::vector<u8>& rgb, u32 width, u32 height) {
+  // Each scanline is prefixed with filter type 0 (none)
+  std::string raw;
+  raw.reserve((width * 3 + 1) * height);
+  for (u32 y = 0; y < height; y++) {
+    raw.push_back(0);
+    raw.append((const char*)&rgb[y * width * 3], width * 3);
+  }
+
+  std::string zlib = {0x78, 0x01};
+  for (u32 offset = 0; offset < raw.size() || offset == 0;) {
+    u32 length = std::min<u32>(raw.size() - offset, 65535);
+    bool last = offset + length == raw.size();
+    zlib.push_back(last ? 1 : 0);
+    zlib.push_back(char(length));
+    zlib.push_back(char(length >> 8));
+    zlib.push_back(char(~length));
+    zlib.push_back(char(~length >> 8));
+    zlib.append(raw, offset, length);
+    offset += length;
+    if (last)
+      break;
+  }
+  appendBigEndian(zlib, adler32((const u8*)raw.data(), raw.size()));
+
+  std::string header;
+  appendBigEndian(header, width);
+  appendBigEndian(header, height);
+  header += {8, 2, 0, 0, 0};  // 8 bit RGB, no interlace
+
+  std::string png = "\x89PNG\r\n\x1a\n";
+  appendChunk(png, "IHDR", header);
+  appendChunk(png, "IDAT", zlib);
+  appendChunk(png, "IEND", "");
+  return png;
+}
+
+//
+// HTTP
+//
+
+const char* page = R"(<!doctype html>
+<title>raytracer preview</title>
+<body style="background:#222;color:#aaa;font:14px sans-serif;text-align:center">
+<p><img src="/stream" draggable="false" style="cursor:move;max-width:100%"></p>
+<p>Drag to orbit, scroll to dolly (or arrow keys and +/-)</p>
+<script>
+var yaw = 0, pitch = 0, dolly = 1, drag = null;
+function flush() {
+  if (yaw == 0 && pitch == 0 && dolly == 1) return;
+  fetch('/move?yaw=' + yaw + '&pitch=' + pitch + '&dolly=' + dolly);
+  yaw = 0; pitch = 0; dolly = 1;
+}
+setInterval(flush, 50);
+var img = document.querySelector('img');
+img.onmousedown = function(e) { drag = [e.clientX, e.clientY]; };
+onmouseup = function() { drag = null; };
+onmousemove = function(e) {
+  if (!drag) return;
+  yaw -= (e.clientX - drag[0]) * 0.3;
+  pitch += (e.clientY - drag[1]) * 0.3;
+  drag = [e.clientX, e.clientY];
+};
+img.onwheel = function(e) {
+  e.preventDefault();
+  dolly *= e.deltaY > 0 ? 1.1 : 1 / 1.1;
+};
+onkeydown = function(e) {
+  if (e.key == 'ArrowLeft') yaw += 5;
+  if (e.key == 'ArrowRight') yaw -= 5;
+  if (e.key == 'ArrowUp') pitch += 5;
+  if (e.key == 'ArrowDown') pitch -= 5;
+  if (e.key == '+' || e.key == '=') dolly /= 1.1;
+  if (e.key == '-') dolly *= 1.1;
+};
+</script>
+)";
+
+bool sendAll(s32 socket, const char* data, u64 size) {
+  while (size) {
+    ssize_t sent = send(socket, data, size, 0);
+    if (sent <= 0)
+      return false;
+    data += sent;
+    size -= sent;
+  }
+  return true;
+}
+
+bool sendAll(s32 socket, const std::string& data) {
+  return sendAll(socket, data.data(), data.size());
+}
+
+bool sendResponse(s32 socket,
+                  const char* status,
+                  const char* contentType,
+                  const std::string& body) {
+  std::string header = std::string("HTTP/1.0 ") + status +
+                       "\r\nContent-Type: " + contentType +
+                       "\r\nContent-Length: " + std::to_string(body.size()) +
+                       "\r\nCache-Control: no-cache\r\n\r\n";
+  return sendAll(socket, header) && sendAll(socket, body);
+}
+
+// Sends every new frame until the viewer goes away
+void streamFrames(Server* server, s32 socket) {
+  if (!sendAll(socket,
+               "HTTP/1.0 200 OK\r\n"
+               "Content-Type: multipart/x-mixed-replace; boundary=frame\r\n"
+               "Cache-Control: no-cache\r\n\r\n")) {
+    return;
+  }
+
+  u64 lastSent = 0;
+  while (true) {
+    std::shared_ptr<std::string> frame;
+    {
+      std::unique_lock<std::mutex> lock(server->mutex);
+      server->frameReady.wait(lock, [server, lastSent] {
+        return server->frameIndex != lastSent;
+      });
+      frame = server->frame;
+      lastSent = server->frameIndex;
+    }
+
+    std::string partHeader =
+        "--frame\r\nContent-Type: image/png\r\nContent-Length: " +
+        std::to_string(frame->size()) + "\r\n\r\n";
+    if (!sendAll(socket, partHeader) || !sendAll(socket, *frame) ||
+        !sendAll(socket, "\r\n")) {
+      return;
+    }
+  }
+}
+
+f32 queryValue(const std::string& query, const char* name, f32 fallback) {
+  std::string key = std::string(name) + "=";
+  u64 start = 0;
+  while (start < query.size()) {
+    u64 end = query.find('&', start);
+    if (end == std::string::npos)
+      end = query.size();
+    if (query.compare(start, key.size(), key) == 0) {
+      return strtof(query.c_str() + start + key.size(), nullptr);
+    }
+    start = end + 1;
+  }
+  return fallback;
+}
+
+std::string queryString(const std::string& query,
+                        const char* name,
+                        const char* fallback) {
+  std::string key = std::string(name) + "=";
+  u64 start = 0;
+  while (start < query.size()) {
+    u64 end = query.find('&', start);
+    if (end == std::string::npos)
+      end = query.size();
+    if (query.compare(start, key.size(), key) == 0) {
+      return query.substr(start + key.size(), end - start - key.size());
+    }
+    start = end + 1;
+  }
+  return fallback;
+}
+
+void handleConnection(Server* server, s32 socket) {
+  std::string request;
+  char buffer[1024];
+  while (request.find("\r\n\r\n") == std::string::npos &&
+         request.size() < 8192) {
+    ssize_t received = recv(socket, buffer, sizeof(buffer), 0);
+    if (received <= 0)
+      break;
+    request.append(buffer, received);
+  }
+
+  // Only the request line matters, e.g. "GET /move?yaw=5 HTTP/1.1"
+  u64 pathStart = request.find(' ');
+  u64 pathEnd = request.find(' ', pathStart + 1);
+  std::string target = pathStart == std::string::npos
+                           ? ""
+                           : request.substr(pathStart + 1,
+                                            pathEnd - pathStart - 1);
+  u64 queryStart = target.find('?');
+  std::string path = target.substr(0, queryStart);
+  std::string query =
+      queryStart == std::string::npos ? "" : target.substr(queryStart + 1);
+
+  if (path == "/") {
+    sendResponse(socket, "200 OK", "text/html", page);
+
+  } else if (path == "/stream") {
+    streamFrames(server, socket);
+
+  } else if (path == "/frame.png") {
+    std::shared_ptr<std::string> frame;
+    {
+      std::lock_guard<std::mutex> lock(server->mutex);
+      frame = server->frame;
+    }
+    sendResponse(socket, "200 OK", "image/png", frame ? *frame : "");
+
+  } else if (path == "/move") {
+    {
+      std::lock_guard<std::mutex> lock(server->mutex);
+      server->move.yaw += queryValue(query, "yaw", 0);
+      server->move.pitch += queryValue(query, "pitch", 0);
+      server->move.dolly *= max(queryValue(query, "dolly", 1), 0.01f);
+      server->moved = true;
+      server->restart = true;
+    }
+    sendResponse(socket, "204 No Content", "text/plain", "");
+
+  } else {
+    sendResponse(socket, "404 Not Found", "text/plain", "Not found\n");
+  }
+
+  close(socket);
+}
+
+void acceptConnections(Server* server) {
+  while (true) {
+    s32 socket = accept(server->socket, nullptr, nullptr);
+    if (socket < 0)
+      continue;
+    std::thread(handleConnection, server, socket).detach();
+  }
+}
+
+// Starts serving on localhost:port in the background
+Server* startServer(u16 port) {
+  // A viewer closing its tab mid-frame shouldn't kill the render
+  signal(SIGPIPE, SIG_IGN);
+
+  Server* server = new Server();
+  server->port = port;
+  server->frameIndex = 0;
+  server->move = {0, 0, 1};
+  server->moved = false;
+  server->restart = false;
+
+  server->socket = socket(AF_INET, SOCK_STREAM, 0);
+  if (server->socket < 0) {
+    fatal("Failed to create preview socket");
+  }
+
+  s32 reuse = 1;
+  setsockopt(server->socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(server->socket, (sockaddr*)&address, sizeof(address)) < 0 ||
+      listen(server->socket, 16) < 0) {
+    fatal("Failed to listen on the preview port");
+  }
+
+  std::thread(acceptConnections, server).detach();
+  return server;
+}
+
+void publishFrame(Server* server,
+                  const std::vector<u8>& rgb,
+                  u32 width,
+                  u32 height) {
+  auto frame = std::make_shared<std::string>(encodePng(rgb, width, height));
+
+  std::lock_guard<std::mutex> lock(server->mutex);
+  server->frame = frame;
+  server->frameIndex++;
+  server->frameReady.notify_all();
+}
+
+// Takes any camera move made since the last call
+bool takeMove(Server* server, CameraMove& move) {
+  std::lock_guard<std::mutex> lock(server->mutex);
+  if (!server->moved)
+    return false;
+
+  move = server->move;
+  server->move = {0, 0, 1};
+  server->moved = false;
+  server->restart = false;
+  return true;
+}
+
+}  // namespace preview
@@ -0,0 +1,28 @@
+namespace preview {
+
+// A camera move requested from the viewer, applied with camera::orbit()
+struct CameraMove {
+  f32 yaw;
+  f32 pitch;
+  f32 dolly;
+};
+
+// NOTE(johan): A tiny HTTP server on localhost that streams the framebuffer
+// as PNG frames (multipart/x-mixed-replace, which browsers show as a live
+// image) and takes camera moves back from the page. The renderer publishes a
+// frame after each pass and polls for moves between passes.
+struct Server {
+  s32 socket;
+  u16 port;
+
+  std::mutex mutex;
+  std::condition_variable frameReady;
+  std::shared_ptr<std::string> frame;  // Latest PNG
+  u64 frameIndex;
+
+  CameraMove move;  // Accumulated since the renderer last took it
+  bool moved;
+  std::atomic<bool> restart;  // Set on every move to cancel the running pass
+};
+
+}  // namespace preview
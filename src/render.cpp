@@ -0,0 +1,541 @@
+namespace render {
+
+vec3 sky(const camera::Ray& ray) {
+  vec3 unit_direction = normalize(ray.direction);
+  f32 t = 0.5f * (unit_direction.y + 1);
+  return lerp(vec3(1, 1, 1), vec3(0.5, 0.7, 1), t);
+}
+
+// Cone spread after a diffuse bounce, in radians
+const f32 diffuseConeSpread = 0.2f;
+
+// NOTE(johan): Counting sort of this bounce's hits into one contiguous run per
+// material type. Within a run the hits are ordered by material so neighbouring
+// items usually read the same material data. binStart ends up holding the
+// first index of each type, plus the total at the end.
+void sortByMaterial(Batch& batch, u32* binStart) {
+  u32 hitCount = batch.hits.size();
+  u32 counts[material::materialTypeCount] = {};
+
+  for (u32 i = 0; i < hitCount; i++) {
+    counts[u32(batch.hits[i].material->type)]++;
+  }
+
+  binStart[0] = 0;
+  for (u32 type = 0; type < material::materialTypeCount; type++) {
+    binStart[type + 1] = binStart[type] + counts[type];
+  }
+
+  u32 next[material::materialTypeCount];
+  std::copy(binStart, binStart + material::materialTypeCount, next);
+
+  batch.order.resize(hitCount);
+  for (u32 i = 0; i < hitCount; i++) {
+    batch.order[next[u32(batch.hits[i].material->type)]++] = i;
+  }
+
+  const std::vector<Hit>& hits = batch.hits;
+  for (u32 type = 0; type < material::materialTypeCount; type++) {
+    std::sort(batch.order.begin() + binStart[type],
+              batch.order.begin() + binStart[type + 1],
+              [&hits](u32 a, u32 b) {
+                return std::less<material::Material*>()(hits[a].material,
+                                                        hits[b].material);
+              });
+  }
+
+  batch.sortedHits.resize(hitCount);
+  batch.sortedPaths.resize(hitCount);
+  for (u32 i = 0; i < hitCount; i++) {
+    batch.sortedHits[i] = batch.hits[batch.order[i]];
+    batch.sortedPaths[i] = batch.hitPaths[batch.order[i]];
+  }
+}
+
+// The closest hit for every active path, into activeHits and activeFound
+template <bool SpheresOnly, typename World>
+void intersect(const World& world, Batch& batch, f32 tMin) {
+  u32 count = batch.active.size();
+  batch.activeHits.resize(count);
+  batch.activeFound.resize(count);
+  for (u32 i = 0; i < count; i++) {
+    batch.activeFound[i] =
+        findHit<SpheresOnly>(world, batch.paths[batch.active[i]].ray, tMin,
+                             FLT_MAX, batch.activeHits[i]);
+  }
+}
+
+// Out of core the rays are queued up by chunk instead of traced one by one,
+// see paging::findHits()
+template <bool SpheresOnly>
+void intersect(const Scene<paging::ChunkedScene*>& scene,
+               Batch& batch,
+               f32 tMin) {
+  u32 count = batch.active.size();
+  batch.activeRays.resize(count);
+  for (u32 i = 0; i < count; i++) {
+    batch.activeRays[i] = batch.paths[batch.active[i]].ray;
+  }
+
+  paging::findHits(scene.accelerator, batch.activeRays, tMin, batch.queues,
+                   batch.activeHits, batch.activeFound);
+
+  // A sphere only scene has nothing unbounded to test
+  for (u32 i = 0; !SpheresOnly && i < count; i++) {
+    Hit& hit = batch.activeHits[i];
+    if (findHit(scene.unbounded, batch.activeRays[i], tMin,
+                batch.activeFound[i] ? hit.t : FLT_MAX, hit)) {
+      batch.activeFound[i] = 1;
+    }
+  }
+}
+
+// Traces every path in the batch to completion, a bounce at a time. Each
+// bounce first intersects all active paths, then shades the hits grouped by
+// material type so each material's sampling code runs over one contiguous run
+// instead of branching per ray.
+//
+// With a guide, diffuse bounces are sampled from it as well as the BSDF, and
+// while it's training each path's diffuse bounces are remembered so that
+// whatever light the path finds can be recorded at them.
+template <typename Features, typename World>
+void trace(const World& world,
+           Batch& batch,
+           u32 maxDepth,
+           guide::Guide* guide,
+           const PixelOutput& output) {
+  // Epsilon for ignoring hits around t = 0
+  f32 tMin = 0.001f;
+
+  batch.active.resize(batch.paths.size());
+  for (u32 i = 0; i < batch.active.size(); i++) {
+    batch.active[i] = i;
+  }
+
+  bool recording = guide && guide->training;
+  if (recording) {
+    batch.guideVertices.resize(batch.paths.size() * guide::maxGuideVertices);
+    batch.guideVertexCounts.assign(batch.paths.size(), 0);
+  }
+
+  for (u32 depth = 0; batch.active.size() > 0; depth++) {
+    // Intersect
+    batch.hits.clear();
+    batch.hitPaths.clear();
+    intersect<Features::spheresOnly>(world, batch, tMin);
+    for (u32 i = 0; i < batch.active.size(); i++) {
+      u32 pathIndex = batch.active[i];
+      PathState& path = batch.paths[pathIndex];
+      if (batch.activeFound[i]) {
+        Hit& hit = batch.activeHits[i];
+        f32 distance = hit.t * path.ray.direction.length();
+        hit.coneWidth = path.coneWidth + path.coneSpread * distance;
+        batch.hits.push_back(hit);
+        batch.hitPaths.push_back(pathIndex);
+
+        if (depth == 0) {
+          output.albedo[path.pixel] += material::albedo(hit.material, hit);
+          output.normal[path.pixel] += hit.normal;
+          output.depth[path.pixel] += distance;
+        }
+      } else {
+        vec3 color = path.throughput * sky(path.ray);
+        output.color[path.pixel] += color;
+        output.luminance2[path.pixel] += luminance(color) * luminance(color);
+        if (recording) {
+          guide::recordPath(
+              guide, &batch.guideVertices[pathIndex * guide::maxGuideVertices],
+              batch.guideVertexCounts[pathIndex], color, batch.guideRecords);
+        }
+
+        // NOTE(johan): The sky counts as its own albedo, facing back along
+        // the ray at depth zero, so it stays smooth in the denoiser
+        if (depth == 0) {
+          output.albedo[path.pixel] += sky(path.ray);
+          output.normal[path.pixel] += -normalize(path.ray.direction);
+        }
+      }
+    }
+
+    // Paths that are still bouncing at the depth limit contribute nothing
+    if (depth >= maxDepth)
+      break;
+
+    // Shade
+    u32 binStart[material::materialTypeCount + 1];
+    sortByMaterial(batch, binStart);
+
+    u32 hitCount = batch.sortedHits.size();
+    batch.sortedRays.resize(hitCount);
+    batch.samples.resize(hitCount);
+    batch.scattered.resize(hitCount);
+    if (guide) {
+      batch.guideDTrees.assign(hitCount, guide::noDTree);
+    }
+    for (u32 i = 0; i < hitCount; i++) {
+      batch.sortedRays[i] = batch.paths[batch.sortedPaths[i]].ray;
+    }
+
+    for (u32 type = 0; type < material::materialTypeCount; type++) {
+      u32 begin = binStart[type];
+      u32 count = binStart[type + 1] - begin;
+      if (count && guide && type == u32(material::MaterialType::Diffuse)) {
+        guide::sampleDiffuseBatch(guide, &batch.sortedRays[begin],
+                                  &batch.sortedHits[begin], count,
+                                  &batch.samples[begin],
+                                  &batch.scattered[begin],
+                                  &batch.guideDTrees[begin]);
+      } else if (count) {
+        material::sampleBatch(material::MaterialType(type),
+                              &batch.sortedRays[begin],
+                              &batch.sortedHits[begin], count,
+                              &batch.samples[begin], &batch.scattered[begin]);
+      }
+    }
+
+    batch.active.clear();
+    for (u32 i = 0; i < hitCount; i++) {
+      if (batch.scattered[i]) {
+        PathState& path = batch.paths[batch.sortedPaths[i]];
+        path.ray = {batch.sortedHits[i].p, batch.samples[i].direction};
+        path.throughput *= batch.samples[i].weight;
+
+        // NOTE(johan): A crude ray cone. Specular bounces keep the spread
+        // (ignoring curvature), diffuse ones blur the footprint right out.
+        path.coneWidth = batch.sortedHits[i].coneWidth;
+        if (!batch.samples[i].specular) {
+          path.coneSpread = diffuseConeSpread;
+        }
+
+        u32 pathIndex = batch.sortedPaths[i];
+        if (recording && !batch.samples[i].specular &&
+            batch.guideVertexCounts[pathIndex] < guide::maxGuideVertices) {
+          u32 vertex = pathIndex * guide::maxGuideVertices +
+                       batch.guideVertexCounts[pathIndex]++;
+          batch.guideVertices[vertex] = {path.ray.origin, path.ray.direction,
+                                         path.throughput,
+                                         batch.guideDTrees[i]};
+        }
+        batch.active.push_back(pathIndex);
+      }
+    }
+  }
+
+  if (recording) {
+    guide::recordBatch(guide, batch.guideRecords);
+  }
+}
+
+// Most paths traced as one batch. Rows with more samples than that are done
+// in pieces, so a big request can't make every thread allocate gigabytes.
+const u32 maxBatchPaths = 1 << 16;
+
+// Adds samples more samples to each pixel in row y of the framebuffer
+template <typename Features, typename World>
+void renderRow(const World& world,
+               camera::Camera* camera,
+               u32 y,
+               u32 samples,
+               u32 maxDepth,
+               guide::Guide* guide,
+               Batch& batch,
+               Framebuffer& framebuffer) {
+  u32 width = framebuffer.width;
+  u32 height = framebuffer.height;
+  u32 row = y * width;
+  PixelOutput output = {&framebuffer.color[row], &framebuffer.luminance2[row],
+                        &framebuffer.albedo[row], &framebuffer.normal[row],
+                        &framebuffer.depth[row]};
+
+  u64 pathCount = u64(width) * samples;
+  for (u64 first = 0; first < pathCount; first += maxBatchPaths) {
+    u32 count = std::min<u64>(pathCount - first, maxBatchPaths);
+    batch.paths.resize(count);
+
+    // Cast rays, collecting samples
+    for (u32 i = 0; i < count; i++) {
+      u32 x = (first + i) / samples;
+      f32 u = f32(x + randomUnit()) / f32(width);
+      f32 v = f32(y + randomUnit()) / f32(height);
+
+      PathState& path = batch.paths[i];
+      path.ray = camera::ray<Features::depthOfField>(camera, u, v);
+      path.throughput = vec3(1, 1, 1);
+      path.coneWidth = 0;
+      path.coneSpread = camera->pixelSpread;
+      path.pixel = x;
+    }
+
+    trace<Features>(world, batch, maxDepth, guide, output);
+  }
+}
+
+// Binds a world, camera, guide (if any) and Features into a RowRenderer
+template <typename Features, typename World>
+RowRenderer createRowRenderer(const World& world,
+                              camera::Camera* camera,
+                              u32 maxDepth,
+                              guide::Guide* guide) {
+  return [world, camera, maxDepth, guide](u32 y, u32 samples, Batch& batch,
+                                          Framebuffer& framebuffer) {
+    renderRow<Features>(world, camera, y, samples, maxDepth, guide, batch,
+                        framebuffer);
+  };
+}
+
+// Each row of each pass gets its own random sequence, so an image comes out
+// the same whichever thread renders which row
+inline void seedRow(u32 pass, u32 y) {
+  seedRandom((u64(pass) << 32) | y);
+}
+
+// The first row of a band, each NUMA node has one band of rows
+inline u32 bandStart(u32 band, u32 bandCount, u32 height) {
+  return u64(band) * height / bandCount;
+}
+
+// NOTE(johan): Renders one progressive pass, adding samples to every pixel.
+// Rows are handed out to the threads one at a time. If cancel gets set the
+// pass stops early, leaving some rows with more samples than others, so the
+// caller should clear the framebuffer before carrying on.
+//
+// With a placement each thread is pinned, and takes rows from its own node's
+// band first, only moving on to the other bands once that runs out. Along with
+// placeRows() that keeps most framebuffer writes in local memory.
+bool renderPass(const RowRenderer& renderRow,
+                Framebuffer& framebuffer,
+                u32 samples,
+                u32 threadCount,
+                const std::atomic<bool>* cancel = nullptr,
+                const numa::Placement* placement = nullptr) {
+  u32 bandCount = placement ? placement->nodeCount : 1;
+  std::atomic<u32> nextRow[numa::maxNodes];
+  for (u32 band = 0; band < bandCount; band++) {
+    nextRow[band] = bandStart(band, bandCount, framebuffer.height);
+  }
+  u32 pass = framebuffer.passes++;
+
+  auto worker = [&](u32 threadIndex) {
+    u32 node = 0;
+    if (placement) {
+      numa::pinThread(placement, threadIndex);
+      node = numa::threadNode;
+    }
+
+    Batch batch;
+    for (u32 i = 0; i < bandCount; i++) {
+      u32 band = (node + i) % bandCount;
+      u32 bandEnd = bandStart(band + 1, bandCount, framebuffer.height);
+      while (!cancel || !*cancel) {
+        u32 y = nextRow[band]++;
+        if (y >= bandEnd)
+          break;
+        seedRow(pass, y);
+        renderRow(y, samples, batch, framebuffer);
+      }
+    }
+  };
+
+  // NOTE(johan): Pinning is for good, so with a placement every worker gets
+  // a thread of its own and the caller, along with anything it starts later
+  // (like the denoiser's threads), keeps all of its CPUs
+  std::vector<std::thread> threads;
+  for (u32 i = placement ? 0 : 1; i < threadCount; i++) {
+    threads.push_back(std::thread(worker, i));
+  }
+  if (!placement) {
+    worker(0);
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  if (cancel && *cancel)
+    return false;
+
+  framebuffer.samples += samples;
+  return true;
+}
+
+//
+// Feature dispatch
+//
+
+// Works out which features a scene needs from its camera and all of its
+// entities, including unbounded ones
+SceneFeatures findFeatures(const camera::Camera* camera,
+                           const EntityList& entities) {
+  SceneFeatures features;
+  features.depthOfField = camera->lensRadius > 0;
+  features.spheresOnly = true;
+  for (auto entity : entities) {
+    if (entity->type != entity::EntityType::Sphere) {
+      features.spheresOnly = false;
+    }
+  }
+  return features;
+}
+
+// NOTE(johan): Calls kernel.run<Features>() with the Features that match
+// what the scene uses. Every combination is instantiated up front, so this
+// is the only place the choice is made at runtime.
+template <typename Kernel>
+void dispatch(Kernel& kernel, const SceneFeatures& features) {
+  if (features.depthOfField) {
+    if (features.spheresOnly) {
+      kernel.template run<Features<true, true>>();
+    } else {
+      kernel.template run<Features<true, false>>();
+    }
+  } else {
+    if (features.spheresOnly) {
+      kernel.template run<Features<false, true>>();
+    } else {
+      kernel.template run<Features<false, false>>();
+    }
+  }
+}
+
+void clear(Framebuffer& framebuffer) {
+  u32 pixelCount = framebuffer.width * framebuffer.height;
+  framebuffer.color.assign(pixelCount, vec3(0, 0, 0));
+  framebuffer.luminance2.assign(pixelCount, 0);
+  framebuffer.albedo.assign(pixelCount, vec3(0, 0, 0));
+  framebuffer.normal.assign(pixelCount, vec3(0, 0, 0));
+  framebuffer.depth.assign(pixelCount, 0);
+  framebuffer.samples = 0;
+}
+
+Framebuffer* createFramebuffer(u32 width, u32 height) {
+  Framebuffer* framebuffer = new Framebuffer();
+  framebuffer->width = width;
+  framebuffer->height = height;
+  framebuffer->passes = 0;
+  clear(*framebuffer);
+  return framebuffer;
+}
+
+template <typename T>
+bool bindRows(std::vector<T>& buffer,
+              u32 width,
+              u32 firstRow,
+              u32 endRow,
+              const numa::Placement* placement,
+              u32 node) {
+  return numa::bindMemory(placement, &buffer[firstRow * width],
+                          (endRow - firstRow) * width * sizeof(T), node);
+}
+
+// NOTE(johan): Moves each node's band of rows into its own memory, so the
+// threads renderPass() pins there write locally. Ideally each band would be
+// touched first by its own threads, but the buffers are vectors that get
+// zeroed by whoever creates them, so the pages are moved over afterwards
+// instead. Pages straddling two bands stay where they are.
+void placeRows(Framebuffer& framebuffer, const numa::Placement* placement) {
+  u32 width = framebuffer.width;
+  u32 bandCount = placement->nodeCount;
+  bool placed = true;
+  for (u32 band = 0; band < bandCount; band++) {
+    u32 first = bandStart(band, bandCount, framebuffer.height);
+    u32 end = bandStart(band + 1, bandCount, framebuffer.height);
+    if (first == end)
+      continue;
+    placed &= bindRows(framebuffer.color, width, first, end, placement, band);
+    placed &=
+        bindRows(framebuffer.luminance2, width, first, end, placement, band);
+    placed &= bindRows(framebuffer.albedo, width, first, end, placement, band);
+    placed &= bindRows(framebuffer.normal, width, first, end, placement, band);
+    placed &= bindRows(framebuffer.depth, width, first, end, placement, band);
+  }
+  if (!placed) {
+    std::cerr << "Couldn't move the framebuffer to its NUMA nodes\n";
+  }
+}
+
+// Scales, gamma corrects and quantizes linear colors to 8 bit RGB, with the
+// top row first
+void resolve(const vec3* colors,
+             u32 width,
+             u32 height,
+             f32 scale,
+             std::vector<u8>& rgb,
+             bool gamma = true) {
+  rgb.resize(width * height * 3);
+  u8* out = rgb.data();
+  for (s32 y = height - 1; y >= 0; y--) {
+    for (u32 x = 0; x < width; x++) {
+      // Blend samples (anti-aliasing)
+      vec3 color = colors[y * width + x] * scale;
+
+      // Gamma correct (gamma 2 for now)
+      if (gamma) {
+        color = vec3(sqrt(color.r), sqrt(color.g), sqrt(color.b));
+      }
+
+      *out++ = u8(255.99 * clamp(color.r));
+      *out++ = u8(255.99 * clamp(color.g));
+      *out++ = u8(255.99 * clamp(color.b));
+    }
+  }
+}
+
+void resolve(const Framebuffer& framebuffer, std::vector<u8>& rgb) {
+  f32 scale = framebuffer.samples ? 1.0f / framebuffer.samples : 0;
+  resolve(framebuffer.color.data(), framebuffer.width, framebuffer.height,
+          scale, rgb);
+}
+
+void writePpm(const std::vector<u8>& rgb,
+              u32 width,
+              u32 height,
+              const std::string& path) {
+  std::ofstream outfile(path, std::ios_base::out);
+  outfile << "P3\n" << width << " " << height << "\n255\n";
+  for (u32 i = 0; i < rgb.size(); i += 3) {
+    outfile << u32(rgb[i]) << " " << u32(rgb[i + 1]) << " " << u32(rgb[i + 2])
+            << "\n";
+  }
+}
+
+void writePpm(const Framebuffer& framebuffer, const std::string& path) {
+  std::vector<u8> rgb;
+  resolve(framebuffer, rgb);
+  writePpm(rgb, framebuffer.width, framebuffer.height, path);
+}
+
+// Writes the auxiliary buffers next to the image as <prefix>.albedo.ppm,
+// <prefix>.normal.ppm and <prefix>.depth.ppm. Normals are mapped from [-1, 1]
+// and depth is scaled so the furthest hit is white.
+void writeAovs(const Framebuffer& framebuffer, const std::string& prefix) {
+  u32 width = framebuffer.width;
+  u32 height = framebuffer.height;
+  u32 pixelCount = width * height;
+  f32 scale = framebuffer.samples ? 1.0f / framebuffer.samples : 0;
+  std::vector<u8> rgb;
+
+  resolve(framebuffer.albedo.data(), width, height, scale, rgb);
+  writePpm(rgb, width, height, prefix + ".albedo.ppm");
+
+  // Visualise normals
+  std::vector<vec3> normals(pixelCount);
+  for (u32 i = 0; i < pixelCount; i++) {
+    vec3 normal = framebuffer.normal[i] * scale;
+    normals[i] = 0.5f * vec3(normal.x + 1, normal.y + 1, normal.z + 1);
+  }
+  resolve(normals.data(), width, height, 1, rgb, false);
+  writePpm(rgb, width, height, prefix + ".normal.ppm");
+
+  f32 maxDepth = 0;
+  for (u32 i = 0; i < pixelCount; i++) {
+    maxDepth = max(maxDepth, framebuffer.depth[i] * scale);
+  }
+  std::vector<vec3> depths(pixelCount);
+  for (u32 i = 0; i < pixelCount; i++) {
+    f32 depth = maxDepth > 0 ? framebuffer.depth[i] * scale / maxDepth : 0;
+    depths[i] = vec3(depth, depth, depth);
+  }
+  resolve(depths.data(), width, height, 1, rgb, false);
+  writePpm(rgb, width, height, prefix + ".depth.ppm");
+}
+
+}  // namespace render
@@ -0,0 +1,102 @@
+namespace render {
+
+// NOTE(johan): What a scene actually uses, as template arguments, so each
+// combination gets its own copy of the integrator with the branches for
+// everything else compiled out. SceneFeatures is the same thing at runtime,
+// and dispatch() turns one into the other.
+//
+// Materials aren't one of them: trace() already skips material types with no
+// hits at runtime, so a copy per material set would cost compile time (one
+// for each of 2^materialTypeCount masks) and save next to nothing.
+template <bool DepthOfField, bool SpheresOnly>
+struct Features {
+  static const bool depthOfField = DepthOfField;
+  static const bool spheresOnly = SpheresOnly;
+};
+
+struct SceneFeatures {
+  bool depthOfField;
+  bool spheresOnly;
+};
+
+struct PathState {
+  camera::Ray ray;
+  vec3 throughput;
+  f32 coneWidth;
+  f32 coneSpread;
+  u32 pixel;
+};
+
+// NOTE(johan): Scratch space for shading a batch of paths a bounce at a time.
+// Rays, hits and samples are arrays of whole structs, indexed in parallel.
+// Once sorted by material each kernel walks one contiguous run of them, but
+// the fields within a Hit are still interleaved. Everything is reused
+// between batches to avoid reallocating.
+struct Batch {
+  std::vector<PathState> paths;
+  std::vector<u32> active;
+
+  std::vector<camera::Ray> activeRays;
+  std::vector<Hit> activeHits;
+  std::vector<u8> activeFound;
+  paging::RayQueues queues;
+
+  std::vector<guide::GuideVertex> guideVertices;  // Per path, see trace()
+  std::vector<u8> guideVertexCounts;
+  std::vector<guide::GuideRecord> guideRecords;  // Until the batch is done
+  std::vector<u32> guideDTrees;  // Per sorted hit, from sampleDiffuseBatch()
+
+  std::vector<Hit> hits;
+  std::vector<u32> hitPaths;
+  std::vector<u32> order;
+
+  std::vector<camera::Ray> sortedRays;
+  std::vector<Hit> sortedHits;
+  std::vector<u32> sortedPaths;
+  std::vector<material::BsdfSample> samples;
+  std::vector<u8> scattered;
+};
+
+// NOTE(johan): Accumulates progressive passes. Every buffer holds the sum over
+// all samples taken for each pixel, with row 0 at the bottom of the image.
+// Alongside the color there are auxiliary buffers from each camera ray's first
+// hit (albedo, normal and depth) plus the squared luminance of each sample,
+// which is what the denoiser uses to estimate noise.
+struct Framebuffer {
+  u32 width;
+  u32 height;
+  std::vector<vec3> color;
+  std::vector<f32> luminance2;
+  std::vector<vec3> albedo;
+  std::vector<vec3> normal;
+  std::vector<f32> depth;
+  u32 samples;  // Per pixel, so far
+  u32 passes;   // Ever rendered, used to seed each pass differently
+};
+
+// Where trace() adds each pixel's results, a row of the framebuffer
+struct PixelOutput {
+  vec3* color;
+  f32* luminance2;
+  vec3* albedo;
+  vec3* normal;
+  f32* depth;
+};
+
+// How to render an image, apart from the scene and camera
+struct RenderSettings {
+  u32 width;
+  u32 height;
+  u32 samples;
+  u32 maxDepth;
+  u32 threadCount;
+  bool denoise;
+};
+
+// Adds samples more samples to every pixel in row y, for a scene and camera
+// bound in along with the right Features by createRowRenderer()
+typedef std::function<
+    void(u32 y, u32 samples, Batch& batch, Framebuffer& framebuffer)>
+    RowRenderer;
+
+}  // namespace render
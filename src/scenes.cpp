@@ -0,0 +1,529 @@
+namespace scenes {
+
+// Demo cameras are made at this size, and resized for each render
+const u32 defaultWidth = 480;
+const u32 defaultHeight = 270;
+
+const u32 maxListEntities = 8;
+
+camera::Camera* testWorld(EntityList& entities) {
+  addEntity(entities,
+            entity::createPlane(vec3(0, 0, 0), vec3(0, 1, 0),
+                                material::createDiffuse(vec3(0.5, 0.5, 0.5))));
+
+  addEntity(
+      entities,
+      entity::createSphere(vec3(0, 1, 0), 1, material::createDielectric(1.5)));
+  addEntity(entities,
+            entity::createSphere(vec3(-3, 1, 0), 1,
+                                 material::createDiffuse(vec3(0.4, 0.2, 0.1))));
+  addEntity(entities, entity::createSphere(
+                               vec3(3, 1, 0), 1,
+                               material::createMetal(vec3(0.7, 0.6, 0.5), 1)));
+
+  // addEntity(entities, entity::createSphere(
+  //     vec3(0, 0, -1), 0.5f, material::createDiffuse(vec3(0.1f, 0.2f,
+  //     0.5f))));
+
+  // addEntity(entities, entity::createSphere(
+  //     vec3(0, -100.5f, -1), 100, material::createDiffuse(vec3(0.8f, 0.8f,
+  //     0))));
+
+  // addEntity(entities, entity::createSphere(
+  //     vec3(1, 0, -1), 0.5f, material::createMetal(vec3(0.8f, 0.6f, 0.2f),
+  //     1)));
+
+  // addEntity(entities, entity::createSphere(vec3(-1, 0, -1), 0.5f,
+  //                                       material::createDielectric(1.5f)));
+
+  vec3 up(0, 1, 0);
+  vec3 origin(0, 1, 3);
+  vec3 lookAt(0, 0, -1);
+  f32 aperture = 0.1;
+  f32 focusDistance = 2.5;  //(origin - lookAt).length();
+  return camera::createCamera(origin, lookAt, up, defaultWidth,
+                              defaultHeight, 60, aperture, focusDistance);
+}
+
+camera::Camera* diffuseDemo(EntityList& entities) {
+  addEntity(entities,
+            entity::createPlane(vec3(0, 0, 0), vec3(0, 1, 0),
+                                material::createDiffuse(vec3(0.1, 0.1, 0.1))));
+
+  addEntity(entities,
+            entity::createSphere(vec3(-2, 1, -1), 1,
+                                 material::createDiffuse(vec3(0.5, 0.5, 0.5))));
+  addEntity(entities, entity::createSphere(
+                               vec3(0, 1, -1), 1,
+                               material::createDiffuse(vec3(0.2, 0.45, 0.85))));
+  addEntity(entities,
+            entity::createSphere(vec3(2, 1, -1), 1,
+                                 material::createDiffuse(vec3(0.5, 0.5, 0.5))));
+
+  vec3 up(0, 1, 0);
+  vec3 origin(0, 2, 6);
+  vec3 lookAt(0, 1.2, -1);
+  f32 aperture = 0.1;
+  f32 focusDistance = (origin - lookAt).length();
+  return camera::createCamera(origin, lookAt, up, defaultWidth,
+                              defaultHeight, 30, aperture, focusDistance);
+}
+
+camera::Camera* metalDemo(EntityList& entities) {
+  addEntity(entities,
+            entity::createPlane(vec3(0, 0, 0), vec3(0, 1, 0),
+                                material::createDiffuse(vec3(0.1, 0.1, 0.1))));
+
+  addEntity(entities, entity::createSphere(
+                               vec3(-2, 1, -1), 1,
+                               material::createMetal(vec3(0.5, 0.5, 0.5), 1)));
+  addEntity(entities, entity::createSphere(
+                               vec3(0, 1, -1), 1,
+                               material::createDiffuse(vec3(0.2, 0.45, 0.85))));
+  addEntity(entities, entity::createSphere(vec3(2, 1, -1), 1,
+                                                material::createMetal(
+                                                    vec3(0.5, 0.5, 0.5), 0.3)));
+
+  vec3 up(0, 1, 0);
+  vec3 origin(0, 2, 6);
+  vec3 lookAt(0, 1.2, -1);
+  f32 aperture = 0.1;
+  f32 focusDistance = (origin - lookAt).length();
+  return camera::createCamera(origin, lookAt, up, defaultWidth,
+                              defaultHeight, 30, aperture, focusDistance);
+}
+
+camera::Camera* glassDemo(EntityList& entities) {
+  addEntity(entities,
+            entity::createPlane(vec3(0, 0, 0), vec3(0, 1, 0),
+                                material::createDiffuse(vec3(0.1, 0.1, 0.1))));
+
+  addEntity(entities,
+            entity::createSphere(vec3(-2, 1, -1), 1,
+                                 material::createDiffuse(vec3(0.5, 0.5, 0.5))));
+  addEntity(
+      entities,
+      entity::createSphere(vec3(0, 1, -1), 1, material::createDielectric(1.5)));
+  addEntity(entities,
+            entity::createSphere(vec3(2, 1, -1), 1,
+                                 material::createDiffuse(vec3(0.5, 0.5, 0.5))));
+
+  vec3 up(0, 1, 0);
+  vec3 origin(0, 2, 6);
+  vec3 lookAt(0, 1.2, -1);
+  f32 aperture = 0.1;
+  f32 focusDistance = (origin - lookAt).length();
+  return camera::createCamera(origin, lookAt, up, defaultWidth,
+                              defaultHeight, 30, aperture, focusDistance);
+}
+
+camera::Camera* textureDemo(EntityList& entities) {
+  texture::Texture* checker =
+      texture::createChecker(texture::createConstant(vec3(0.2, 0.3, 0.1)),
+                             texture::createConstant(vec3(0.9, 0.9, 0.9)), 10);
+  // NOTE(johan): The checker is a 3D pattern, so the ground sits just under
+  // y = 0 to keep clear of the pattern's zero crossing there.
+  addEntity(entities,
+            entity::createPlane(vec3(0, -0.001, 0), vec3(0, 1, 0),
+                                material::createDiffuse(checker)));
+
+  addEntity(entities,
+            entity::createSphere(vec3(-2, 1, -1), 1,
+                                 material::createDiffuse(texture::createNoise(
+                                     vec3(0.9, 0.85, 0.8), 4))));
+  addEntity(entities,
+            entity::createSphere(
+                vec3(0, 1, -1), 1,
+                material::createDielectric(
+                    1.5, texture::createConstant(vec3(0.7, 0.9, 0.8)))));
+  addEntity(entities, entity::createSphere(vec3(2, 1, -1), 1,
+                                                material::createMetal(
+                                                    vec3(0.5, 0.5, 0.5), 0.3)));
+
+  vec3 up(0, 1, 0);
+  vec3 origin(0, 2, 6);
+  vec3 lookAt(0, 1.2, -1);
+  f32 aperture = 0.1;
+  f32 focusDistance = (origin - lookAt).length();
+  return camera::createCamera(origin, lookAt, up, defaultWidth,
+                              defaultHeight, 30, aperture, focusDistance);
+}
+
+camera::Camera* spheresWorld(EntityList& entities) {
+  addEntity(entities,
+            entity::createPlane(vec3(0, 0, 0), vec3(0, 1, 0),
+                                material::createDiffuse(vec3(0.5, 0.5, 0.5))));
+
+  for (s32 a = -11; a < 11; a++) {
+    for (s32 b = -11; b < 11; b++) {
+      f32 chooseMat = drand48();
+      vec3 center(a + 0.9 * drand48(), 0.2, b + 0.9 * drand48());
+      if ((center - vec3(4, 0.2, 0)).length() > 0.9) {
+        if (chooseMat < 0.8) {
+          addEntity(entities,
+                    entity::createSphere(
+                        center, 0.2,
+                        material::createDiffuse(vec3(drand48() * drand48(),
+                                                     drand48() * drand48(),
+                                                     drand48() * drand48()))));
+
+        } else if (chooseMat < 0.90) {
+          addEntity(entities,
+                    entity::createSphere(
+                        center, 0.2,
+                        material::createMetal(
+                            vec3(0.5 * (1 + drand48()), 0.5 * (1 + drand48()),
+                                 0.5 * (1 + drand48())),
+                            1 - (0.5 * drand48()))));
+
+        } else {
+          addEntity(entities,
+                    entity::createSphere(center, 0.2,
+                                         material::createDielectric(1.5)));
+        }
+      }
+    }
+  }
+
+  addEntity(
+      entities,
+      entity::createSphere(vec3(0, 1, 0), 1, material::createDielectric(1.5)));
+  addEntity(entities,
+            entity::createSphere(vec3(-4, 1, 0), 1,
+                                 material::createDiffuse(vec3(0.4, 0.2, 0.1))));
+  addEntity(entities, entity::createSphere(
+                               vec3(4, 1, 0), 1,
+                               material::createMetal(vec3(0.7, 0.6, 0.5), 1)));
+
+  vec3 up(0, 1, 0);
+  vec3 origin(13, 2, 3);
+  vec3 lookAt(0, 0, 0);
+  f32 aperture = 0.0;
+  f32 focusDistance = 10;
+  return camera::createCamera(origin, lookAt, up, defaultWidth,
+                              defaultHeight, 20, aperture, focusDistance);
+}
+
+//
+// Stress scenes
+//
+
+// NOTE(johan): Glass in front of glass, so most paths are long chains of
+// specular bounces and the noise is in hard to find caustics.
+camera::Camera* glassStackWorld(EntityList& entities) {
+  addEntity(entities,
+            entity::createPlane(vec3(0, 0, 0), vec3(0, 1, 0),
+                                material::createDiffuse(vec3(0.6, 0.6, 0.6))));
+
+  material::Material* glass = material::createDielectric(1.5);
+  material::Material* tinted = material::createDielectric(
+      1.5, texture::createConstant(vec3(0.8, 0.9, 1)));
+  for (s32 row = 0; row < 4; row++) {
+    for (s32 column = -3; column <= 3; column++) {
+      vec3 center(column * 0.9 + (row % 2) * 0.45, 0.5, -row * 0.9);
+      addEntity(entities, entity::createSphere(center, 0.5,
+                                               row % 2 ? tinted : glass));
+    }
+  }
+
+  vec3 up(0, 1, 0);
+  vec3 origin(0, 2.5, 5);
+  vec3 lookAt(0, 0.5, -1.5);
+  f32 aperture = 0.0;
+  f32 focusDistance = (origin - lookAt).length();
+  return camera::createCamera(origin, lookAt, up, defaultWidth,
+                              defaultHeight, 35, aperture, focusDistance);
+}
+
+// NOTE(johan): Two mirrors facing each other, paths bounce between them until
+// the depth limit with little light lost along the way.
+camera::Camera* mirrorsWorld(EntityList& entities) {
+  addEntity(entities,
+            entity::createPlane(vec3(0, 0, 0), vec3(0, 1, 0),
+                                material::createDiffuse(vec3(0.3, 0.3, 0.3))));
+
+  material::Material* mirror = material::createMetal(vec3(0.95, 0.95, 0.95), 0);
+  addEntity(entities, entity::createPlane(vec3(-1.8, 1.5, 0), vec3(1, 0, 0),
+                                          3, 3, mirror));
+  addEntity(entities, entity::createPlane(vec3(1.8, 1.5, 0), vec3(-1, 0, 0),
+                                          3, 3, mirror));
+  addEntity(entities,
+            entity::createSphere(vec3(0, 0.6, 0), 0.6,
+                                 material::createDiffuse(vec3(0.8, 0.3, 0.2))));
+
+  vec3 up(0, 1, 0);
+  vec3 origin(0.4, 1.6, 5);
+  vec3 lookAt(-0.6, 0.8, 0);
+  f32 aperture = 0.0;
+  f32 focusDistance = (origin - lookAt).length();
+  return camera::createCamera(origin, lookAt, up, defaultWidth,
+                              defaultHeight, 50, aperture, focusDistance);
+}
+
+// NOTE(johan): A cloud of tiny spheres, far more than any other demo, so the
+// acceleration structure does most of the work. It reseeds drand48 so the
+// cloud is the same whatever was built before it.
+camera::Camera* denseWorld(EntityList& entities) {
+  srand48(38);
+
+  const u32 paletteSize = 16;
+  material::Material* palette[paletteSize];
+  for (u32 i = 0; i < paletteSize; i++) {
+    vec3 color(drand48(), drand48(), drand48());
+    palette[i] = i % 4 == 0 ? material::createMetal(color, 0.2)
+                            : material::createDiffuse(color);
+  }
+
+  for (u32 i = 0; i < 20000; i++) {
+    vec3 offset;
+    do {
+      offset = vec3(2 * drand48() - 1, 2 * drand48() - 1, 2 * drand48() - 1);
+    } while (dot(offset, offset) >= 1);
+    addEntity(entities,
+              entity::createSphere(vec3(0, 2.2, 0) + 2 * offset, 0.03,
+                                   palette[i % paletteSize]));
+  }
+  addEntity(entities,
+            entity::createPlane(vec3(0, 0, 0), vec3(0, 1, 0),
+                                material::createDiffuse(vec3(0.5, 0.5, 0.5))));
+
+  vec3 up(0, 1, 0);
+  vec3 origin(0, 3, 7);
+  vec3 lookAt(0, 2, 0);
+  f32 aperture = 0.0;
+  f32 focusDistance = (origin - lookAt).length();
+  return camera::createCamera(origin, lookAt, up, defaultWidth,
+                              defaultHeight, 40, aperture, focusDistance);
+}
+
+typedef camera::Camera* (*BuildFn)(EntityList& entities);
+
+struct Demo {
+  const char* name;
+  BuildFn build;
+};
+
+const Demo demos[] = {
+    {"test", testWorld},       {"diffuse", diffuseDemo},
+    {"metal", metalDemo},      {"glass", glassDemo},
+    {"texture", textureDemo},  {"spheres", spheresWorld},
+    {"glass-stack", glassStackWorld}, {"mirrors", mirrorsWorld},
+    {"dense", denseWorld},
+};
+
+void printBvh(bvh::BoundingVolume* bvh, u32 depth = 0) {
+  auto spacer = std::string(depth * 4, ' ');
+  std::cout << spacer << bvh->entities.size() << " entities ["
+            << bvh->box.minPoint << ", " << bvh->box.maxPoint << "]\n";
+  if (bvh->left) {
+    printBvh(bvh->left, depth + 1);
+  }
+  if (bvh->right) {
+    printBvh(bvh->right, depth + 1);
+  }
+}
+
+// The compact BVH, and the chunks written from it, only hold spheres
+bool onlySpheres(const EntityList& entities) {
+  for (auto entity : entities) {
+    if (entity->type != entity::EntityType::Sphere)
+      return false;
+  }
+  return true;
+}
+
+// Builds the named demo and its acceleration structure, null if there's no
+// demo by that name. Scenes with bounded entities other than spheres get a
+// BVH when asked for a compact one. OutOfCore builds no acceleration
+// structure at all, openChunks() has to be called next.
+LoadedScene* load(const char* name, AcceleratorType acceleratorType) {
+  const Demo* demo = nullptr;
+  for (auto& candidate : demos) {
+    if (!strcmp(candidate.name, name)) {
+      demo = &candidate;
+    }
+  }
+  if (!demo)
+    return nullptr;
+
+  LoadedScene* scene = new LoadedScene();
+  scene->name = name;
+  scene->camera = demo->build(scene->entities);
+  scene->features = render::findFeatures(scene->camera, scene->entities);
+  scene->bvh = nullptr;
+  scene->compactBvh = nullptr;
+  scene->chunks = nullptr;
+
+  // Infinite planes stay out of the acceleration structure
+  splitUnbounded(scene->entities, scene->unbounded);
+  if (!getBoundingBox(scene->entities, scene->bounds)) {
+    scene->bounds =
+        bvh::createAABB(scene->camera->origin, scene->camera->origin);
+  }
+
+  if (acceleratorType == AcceleratorType::Auto) {
+    acceleratorType = scene->entities.size() <= maxListEntities
+                          ? AcceleratorType::List
+                          : AcceleratorType::Bvh;
+  }
+  if (acceleratorType == AcceleratorType::CompactBvh &&
+      !onlySpheres(scene->entities)) {
+    std::cerr << "The compact BVH only holds spheres, " << name
+              << " gets a BVH instead\n";
+    acceleratorType = AcceleratorType::Bvh;
+  }
+  scene->acceleratorType = acceleratorType;
+
+  if (acceleratorType != AcceleratorType::List &&
+      acceleratorType != AcceleratorType::OutOfCore) {
+#if USE_SPATIAL_SPLITS
+    scene->bvh = bvh::createSpatialBvh(scene->entities);
+#else
+    scene->bvh = new bvh::BoundingVolume(scene->entities);
+#endif
+    // printBvh(scene->bvh);
+  }
+
+  if (acceleratorType == AcceleratorType::CompactBvh) {
+    // NOTE(johan): u16 keeps the boxes tight, u8 halves node size again at
+    // the cost of looser boxes.
+    scene->compactBvh = bvh::createCompactBvh<u16>(scene->bvh);
+    std::cerr << "BVH: " << bvh::memoryUsage(scene->bvh)
+              << " bytes, compact " << bvh::memoryUsage(scene->compactBvh)
+              << " bytes\n";
+  }
+
+  return scene;
+}
+
+// NOTE(johan): Copies the compact BVH onto every NUMA node, so each render
+// thread traverses a copy in its own node's memory. Only the compact BVH can
+// be copied like this, being flat and holding its spheres by value. The
+// materials and textures, and the unbounded entities, are still shared.
+void replicate(LoadedScene* scene, const numa::Placement* placement) {
+  if (!scene->compactBvh) {
+    std::cerr << "Only the compact BVH can be replicated\n";
+    return;
+  }
+  scene->replicas.resize(placement->nodeCount);
+  for (u32 node = 0; node < placement->nodeCount; node++) {
+    numa::runOnNode(placement, node, [scene, node] {
+      scene->replicas[node] = new bvh::CompactBvh<u16>(*scene->compactBvh);
+    });
+  }
+}
+
+// Where writeChunks() notes which scene the chunks are for, since the chunks
+// refer to its materials by index
+std::string sceneNamePath(const std::string& directory) {
+  return directory + "/scene";
+}
+
+// NOTE(johan): Writes the scene's BVH out to directory in chunks of up to
+// chunkSize spheres, to be rendered from later with openChunks(). The demos
+// are generated in memory so they're fully built before being written out,
+// but a real dataset would be converted straight from its own files. Returns
+// false if the scene has bounded entities other than spheres.
+bool writeChunks(const LoadedScene* scene,
+                 const std::string& directory,
+                 u32 chunkSize) {
+  if (!scene->bvh || !onlySpheres(scene->entities))
+    return false;
+
+  u32 chunkCount = paging::writeChunks(scene->bvh, directory, chunkSize);
+  std::ofstream file(sceneNamePath(directory));
+  file << scene->name << "\n";
+  if (!file) {
+    fatal("Failed to write the chunks' scene name");
+  }
+  std::cerr << "Wrote " << chunkCount << " chunks to " << directory << "\n";
+  return true;
+}
+
+// NOTE(johan): Switches a scene loaded with AcceleratorType::OutOfCore over
+// to paging its chunks in from directory, keeping at most budget bytes of them
+// mapped. The bounded entities are freed, leaving only the camera, the
+// materials and the infinite planes in memory. Returns false if directory
+// doesn't hold chunks written for this scene.
+bool openChunks(LoadedScene* scene, const std::string& directory, u64 budget) {
+  std::ifstream file(sceneNamePath(directory));
+  std::string name;
+  if (!std::getline(file, name) || name != scene->name)
+    return false;
+
+  scene->chunks = paging::openChunks(directory, budget);
+  for (auto entity : scene->entities) {
+    free(entity);
+  }
+  scene->entities.clear();
+  scene->entities.shrink_to_fit();
+  std::cerr << "Paging " << scene->chunks->chunks.size() << " chunks from "
+            << directory << "\n";
+  return true;
+}
+
+// The kernel for render::dispatch(), binds a world to the Features it needs
+template <typename World>
+struct RowRendererKernel {
+  World world;
+  camera::Camera* camera;
+  u32 maxDepth;
+  guide::Guide* guide;
+  render::RowRenderer result;
+
+  template <typename Features>
+  void run() {
+    result =
+        render::createRowRenderer<Features>(world, camera, maxDepth, guide);
+  }
+};
+
+template <typename World>
+render::RowRenderer createRowRenderer(const World& world,
+                                      const render::SceneFeatures& features,
+                                      camera::Camera* camera,
+                                      u32 maxDepth,
+                                      guide::Guide* guide) {
+  RowRendererKernel<World> kernel = {world, camera, maxDepth, guide};
+  render::dispatch(kernel, features);
+  return kernel.result;
+}
+
+// A RowRenderer for the scene seen through camera, which should have been
+// made for the framebuffer's size, guided by guide if there is one
+render::RowRenderer createRowRenderer(const LoadedScene* scene,
+                                      camera::Camera* camera,
+                                      u32 maxDepth,
+                                      guide::Guide* guide = nullptr) {
+  const render::SceneFeatures& features = scene->features;
+  if (!scene->replicas.empty()) {
+    std::vector<render::RowRenderer> renderers;
+    for (auto replica : scene->replicas) {
+      renderers.push_back(
+          createRowRenderer(createScene(replica, scene->unbounded), features,
+                            camera, maxDepth, guide));
+    }
+    return [renderers](u32 y, u32 samples, render::Batch& batch,
+                       render::Framebuffer& framebuffer) {
+      renderers[numa::threadNode](y, samples, batch, framebuffer);
+    };
+  }
+
+  switch (scene->acceleratorType) {
+    case AcceleratorType::CompactBvh:
+      return createRowRenderer(
+          createScene(scene->compactBvh, scene->unbounded), features, camera,
+          maxDepth, guide);
+    case AcceleratorType::OutOfCore:
+      return createRowRenderer(createScene(scene->chunks, scene->unbounded),
+                               features, camera, maxDepth, guide);
+    case AcceleratorType::Bvh:
+      return createRowRenderer(createScene(scene->bvh, scene->unbounded),
+                               features, camera, maxDepth, guide);
+    default:
+      return createRowRenderer(createScene(scene->entities, scene->unbounded),
+                               features, camera, maxDepth, guide);
+  }
+}
+
+}  // namespace scenes
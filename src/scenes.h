@@ -0,0 +1,27 @@
+namespace scenes {
+
+// NOTE(johan): Auto uses a flat list for scenes too small for a BVH to pay
+// off. The compact BVH is only ever used when asked for, it saves memory on
+// big scenes but isn't faster. OutOfCore pages chunks of the scene in from
+// disk, see openChunks().
+enum class AcceleratorType { Auto, List, Bvh, CompactBvh, OutOfCore };
+
+// NOTE(johan): A scene built once and kept ready to render, with the camera it
+// was set up with and its acceleration structure. Nothing in here changes
+// while rendering, so any number of renders can share one.
+struct LoadedScene {
+  std::string name;
+  EntityList entities;   // Everything with a bounding box
+  EntityList unbounded;  // Infinite planes, tested outside the accelerator
+  bvh::AABB bounds;      // Of entities, kept when they're paged out
+  camera::Camera* camera;
+  render::SceneFeatures features;
+  AcceleratorType acceleratorType;
+  bvh::BoundingVolume* bvh;
+  bvh::CompactBvh<u16>* compactBvh;
+  paging::ChunkedScene* chunks;
+  // Copies of compactBvh, one per NUMA node, see replicate()
+  std::vector<bvh::CompactBvh<u16>*> replicas;
+};
+
+}  // namespace scenes
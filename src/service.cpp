@@ -0,0 +1,302 @@
+namespace service {
+
+// Limits on what a single request can ask for
+const u32 maxImageSize = 4096;
+const u32 maxSamples = 1 << 16;
+const u32 maxDepthLimit = 1000;
+const u32 passesPerJob = 10;
+
+// NOTE(johan): Framebuffers take around 60 bytes a pixel, so a full size
+// request is about a gigabyte. Jobs wait for their turn once the ones already
+// running have this many pixels between them, rather than any number of
+// clients being able to run the service out of memory.
+const u64 maxPixelsInFlight = u64(maxImageSize) * maxImageSize;
+
+//
+// Thread pool
+//
+
+void work(ThreadPool* pool,
+          const numa::Placement* placement,
+          u32 threadIndex) {
+  if (placement) {
+    numa::pinThread(placement, threadIndex);
+  }
+
+  render::Batch batch;
+  std::unique_lock<std::mutex> lock(pool->mutex);
+  while (true) {
+    pool->workReady.wait(
+        lock, [pool] { return pool->stopping || !pool->jobs.empty(); });
+    if (pool->jobs.empty())
+      return;
+
+    Job* job = pool->jobs.front();
+    pool->jobs.pop_front();
+    u32 y = job->nextRow++;
+    if (job->nextRow < job->framebuffer->height) {
+      pool->jobs.push_back(job);
+    }
+    lock.unlock();
+
+    render::seedRow(job->pass, y);
+    job->renderRow(y, job->passSamples, batch, *job->framebuffer);
+
+    lock.lock();
+    if (++job->rowsDone == job->framebuffer->height) {
+      job->passDone.notify_all();
+    }
+  }
+}
+
+// Pins the threads with placement, if there is one
+ThreadPool* createThreadPool(u32 threadCount,
+                             const numa::Placement* placement) {
+  ThreadPool* pool = new ThreadPool();
+  pool->stopping = false;
+  for (u32 i = 0; i < threadCount; i++) {
+    pool->threads.push_back(std::thread(work, pool, placement, i));
+  }
+  return pool;
+}
+
+// Lets the threads finish whatever rows are left, joins them and frees the
+// pool. No more passes can be started on it.
+void destroyThreadPool(ThreadPool* pool) {
+  {
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    pool->stopping = true;
+  }
+  pool->workReady.notify_all();
+  for (auto& thread : pool->threads) {
+    thread.join();
+  }
+  delete pool;
+}
+
+// Adds samples more samples to every pixel of the job's framebuffer, waiting
+// until the pool has rendered all of its rows
+void renderPass(ThreadPool* pool, Job* job, u32 samples) {
+  std::unique_lock<std::mutex> lock(pool->mutex);
+  job->passSamples = samples;
+  job->pass = job->framebuffer->passes++;
+  job->nextRow = 0;
+  job->rowsDone = 0;
+  pool->jobs.push_back(job);
+  pool->workReady.notify_all();
+
+  job->passDone.wait(lock, [job] {
+    return job->rowsDone == job->framebuffer->height;
+  });
+  job->framebuffer->samples += samples;
+}
+
+//
+// Requests
+//
+
+struct Request {
+  const scenes::LoadedScene* scene;
+  u32 width;
+  u32 height;
+  u32 samples;
+  u32 maxDepth;
+  preview::CameraMove move;
+};
+
+// Fills in request from a line like "scene=metal&width=160", returning an
+// error message if it's no good or null if it is
+const char* parseRequest(Service* service,
+                         const std::string& line,
+                         Request& request) {
+  std::string name = preview::queryString(line, "scene", "");
+  request.scene = nullptr;
+  for (auto scene : service->scenes) {
+    if (scene->name == name) {
+      request.scene = scene;
+    }
+  }
+  if (!request.scene)
+    return "unknown scene";
+
+  f32 width = preview::queryValue(line, "width", scenes::defaultWidth);
+  f32 height = preview::queryValue(line, "height", scenes::defaultHeight);
+  f32 samples = preview::queryValue(line, "samples", 100);
+  f32 maxDepth = preview::queryValue(line, "depth", 50);
+  if (!(width >= 1 && width <= maxImageSize && height >= 1 &&
+        height <= maxImageSize)) {
+    return "bad image size";
+  }
+  if (!(samples >= 1 && samples <= maxSamples))
+    return "bad sample count";
+  if (!(maxDepth >= 1 && maxDepth <= maxDepthLimit))
+    return "bad depth";
+
+  request.width = width;
+  request.height = height;
+  request.samples = samples;
+  request.maxDepth = maxDepth;
+  request.move.yaw = preview::queryValue(line, "yaw", 0);
+  request.move.pitch = preview::queryValue(line, "pitch", 0);
+  request.move.dolly = max(preview::queryValue(line, "dolly", 1), 0.01f);
+  return nullptr;
+}
+
+// Renders a request, streaming a frame back after every pass. Returns false
+// if the client went away.
+bool runJob(Service* service, const Request& request, s32 socket) {
+  auto start = std::chrono::steady_clock::now();
+
+  u64 pixels = u64(request.width) * request.height;
+  {
+    std::unique_lock<std::mutex> lock(service->admissionMutex);
+    service->pixelsFreed.wait(lock, [service, pixels] {
+      return service->pixelsInFlight + pixels <= maxPixelsInFlight;
+    });
+    service->pixelsInFlight += pixels;
+  }
+
+  camera::Camera* resized =
+      camera::resize(request.scene->camera, request.width, request.height);
+  camera::Camera* camera =
+      camera::orbit(resized, request.move.yaw, request.move.pitch,
+                    request.move.dolly);
+  free(resized);
+
+  Job job;
+  job.renderRow =
+      scenes::createRowRenderer(request.scene, camera, request.maxDepth);
+  job.framebuffer = render::createFramebuffer(request.width, request.height);
+
+  bool connected = true;
+  u32 passSamples = std::max(request.samples / passesPerJob, 1u);
+  std::vector<u8> rgb;
+  while (connected && job.framebuffer->samples < request.samples) {
+    u32 passSize =
+        std::min(passSamples, request.samples - job.framebuffer->samples);
+    renderPass(service->pool, &job, passSize);
+
+    render::resolve(*job.framebuffer, rgb);
+    std::string png = preview::encodePng(rgb, request.width, request.height);
+    std::string header = "frame " + std::to_string(job.framebuffer->samples) +
+                         " " + std::to_string(request.width) + " " +
+                         std::to_string(request.height) + " " +
+                         std::to_string(png.size()) + "\n";
+    connected = preview::sendAll(socket, header) &&
+                preview::sendAll(socket, png);
+  }
+
+  delete job.framebuffer;
+  free(camera);
+  {
+    std::lock_guard<std::mutex> lock(service->admissionMutex);
+    service->pixelsInFlight -= pixels;
+  }
+  service->pixelsFreed.notify_all();
+
+  auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+  return connected &&
+         preview::sendAll(socket,
+                          "done " + std::to_string(elapsed.count()) + "\n");
+}
+
+// Serves requests from one client, one after another, until it hangs up
+void handleConnection(Service* service, s32 socket) {
+  std::string received;
+  char buffer[1024];
+  bool connected = true;
+  while (connected) {
+    u64 end = received.find('\n');
+    if (end == std::string::npos) {
+      if (received.size() > 8192)
+        break;
+      ssize_t size = recv(socket, buffer, sizeof(buffer), 0);
+      if (size <= 0)
+        break;
+      received.append(buffer, size);
+      continue;
+    }
+
+    std::string line = received.substr(0, end);
+    received.erase(0, end + 1);
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    if (line.empty())
+      continue;
+
+    Request request;
+    const char* error = parseRequest(service, line, request);
+    if (error) {
+      connected = preview::sendAll(socket, std::string("error ") + error +
+                                               "\n");
+    } else {
+      connected = runJob(service, request, socket);
+    }
+  }
+
+  close(socket);
+}
+
+void acceptConnections(Service* service) {
+  while (true) {
+    s32 socket = accept(service->socket, nullptr, nullptr);
+    if (socket < 0)
+      continue;
+    std::thread(handleConnection, service, socket).detach();
+  }
+}
+
+// Loads every demo scene, starts the thread pool and serves on the socket at
+// path until the process is killed. With a placement the pool's threads are
+// pinned, and if replicateScenes is set scenes with a compact BVH get a copy
+// on every node.
+void run(const char* path,
+         scenes::AcceleratorType acceleratorType,
+         u32 threadCount,
+         const numa::Placement* placement,
+         bool replicateScenes) {
+  // A client hanging up mid-frame shouldn't kill the service
+  signal(SIGPIPE, SIG_IGN);
+
+  Service* service = new Service();
+  service->path = path;
+  service->pixelsInFlight = 0;
+
+  // NOTE(johan): Building scenes touches globals (the material table and
+  // drand48) so they're all built here before any job can be running.
+  for (auto& demo : scenes::demos) {
+    scenes::LoadedScene* scene = scenes::load(demo.name, acceleratorType);
+    if (placement && replicateScenes && scene->compactBvh) {
+      scenes::replicate(scene, placement);
+    }
+    service->scenes.push_back(scene);
+  }
+  service->pool = createThreadPool(threadCount, placement);
+
+  service->socket = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (service->socket < 0) {
+    fatal("Failed to create service socket");
+  }
+
+  sockaddr_un address = {};
+  address.sun_family = AF_UNIX;
+  if (service->path.size() >= sizeof(address.sun_path)) {
+    fatal("Service socket path is too long");
+  }
+  strcpy(address.sun_path, path);
+
+  // Left behind by an earlier run that didn't exit cleanly
+  unlink(path);
+  if (bind(service->socket, (sockaddr*)&address, sizeof(address)) < 0 ||
+      listen(service->socket, 16) < 0) {
+    fatal("Failed to listen on the service socket");
+  }
+
+  std::cerr << "Serving " << service->scenes.size() << " scenes on " << path
+            << " with " << threadCount << " threads\n";
+  acceptConnections(service);
+}
+
+}  // namespace service
@@ -0,0 +1,46 @@
+namespace service {
+
+// NOTE(johan): A render request being worked on. Jobs are rendered a pass at
+// a time like the preview, and while a pass is running its rows are handed out
+// to the pool. Everything but renderRow and framebuffer is guarded by the
+// pool's mutex.
+struct Job {
+  render::RowRenderer renderRow;
+  render::Framebuffer* framebuffer;
+  u32 passSamples;  // Per pixel, for the pass in flight
+  u32 pass;
+  u32 nextRow;   // Next row to hand out
+  u32 rowsDone;  // Rows finished so far this pass
+  std::condition_variable passDone;
+};
+
+// NOTE(johan): Threads shared by every job. Each thread takes one row from the
+// job at the front and moves that job to the back, so concurrent jobs get rows
+// round robin and a big render can't hold up a thumbnail behind it.
+struct ThreadPool {
+  std::mutex mutex;
+  std::condition_variable workReady;
+  std::list<Job*> jobs;  // Only those with rows left to hand out
+  std::vector<std::thread> threads;
+  bool stopping;  // Set by destroyThreadPool(), the threads then exit
+};
+
+// NOTE(johan): A render service listening on a Unix socket. The scenes are
+// all loaded up front and kept, so a job only pays for its own rendering.
+// Clients send one request per line, a query string such as
+// "scene=metal&width=160&height=90&samples=16", and get back a
+// "frame <samples> <width> <height> <bytes>" line followed by that many bytes
+// of PNG after every pass, then "done <milliseconds>" once it's finished or
+// "error <message>" if it can't be rendered.
+struct Service {
+  s32 socket;
+  std::string path;
+  std::vector<scenes::LoadedScene*> scenes;
+  ThreadPool* pool;
+
+  std::mutex admissionMutex;
+  std::condition_variable pixelsFreed;
+  u64 pixelsInFlight;  // Of every job's framebuffer, see maxPixelsInFlight
+};
+
+}  // namespace service
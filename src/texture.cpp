@@ -0,0 +1,522 @@
+namespace texture {
+
+//
+// Perlin noise
+//
+
+// NOTE(johan): Ken Perlin's gradient noise, as in Ray Tracing: The Next Week.
+// There's a single shared table which is filled the first time a noise
+// texture is created.
+const u32 perlinPointCount = 256;
+
+struct Perlin {
+  vec3 gradients[perlinPointCount];
+  u32 permX[perlinPointCount];
+  u32 permY[perlinPointCount];
+  u32 permZ[perlinPointCount];
+};
+
+Perlin* perlin;
+
+void generatePermutation(u32* perm) {
+  for (u32 i = 0; i < perlinPointCount; i++) {
+    perm[i] = i;
+  }
+  for (u32 i = perlinPointCount - 1; i > 0; i--) {
+    u32 target = u32(drand48() * (i + 1));
+    std::swap(perm[i], perm[target]);
+  }
+}
+
+Perlin* createPerlin() {
+  Perlin* result = (Perlin*)malloc(sizeof(Perlin));
+  for (u32 i = 0; i < perlinPointCount; i++) {
+    result->gradients[i] = normalize(randomPointInUnitSphere());
+  }
+  generatePermutation(result->permX);
+  generatePermutation(result->permY);
+  generatePermutation(result->permZ);
+  return result;
+}
+
+f32 noise(const Perlin* perlin, const vec3& p) {
+  f32 u = p.x - floor(p.x);
+  f32 v = p.y - floor(p.y);
+  f32 w = p.z - floor(p.z);
+  s32 i = s32(floor(p.x));
+  s32 j = s32(floor(p.y));
+  s32 k = s32(floor(p.z));
+
+  // Hermite smoothing
+  f32 uu = u * u * (3 - 2 * u);
+  f32 vv = v * v * (3 - 2 * v);
+  f32 ww = w * w * (3 - 2 * w);
+
+  f32 accumulated = 0;
+  for (s32 di = 0; di < 2; di++) {
+    for (s32 dj = 0; dj < 2; dj++) {
+      for (s32 dk = 0; dk < 2; dk++) {
+        const vec3& gradient =
+            perlin->gradients[perlin->permX[(i + di) & 255] ^
+                              perlin->permY[(j + dj) & 255] ^
+                              perlin->permZ[(k + dk) & 255]];
+        vec3 weight(u - di, v - dj, w - dk);
+        accumulated += (di * uu + (1 - di) * (1 - uu)) *
+                       (dj * vv + (1 - dj) * (1 - vv)) *
+                       (dk * ww + (1 - dk) * (1 - ww)) * dot(gradient, weight);
+      }
+    }
+  }
+  return accumulated;
+}
+
+f32 turbulence(const Perlin* perlin, vec3 p, u32 octaves = 7) {
+  f32 accumulated = 0;
+  f32 weight = 1;
+  for (u32 i = 0; i < octaves; i++) {
+    accumulated += weight * noise(perlin, p);
+    weight *= 0.5f;
+    p *= 2;
+  }
+  return fabs(accumulated);
+}
+
+//
+// Image loading and mip generation
+//
+
+bool readPpmToken(FILE* file, u32& value) {
+  s32 c = fgetc(file);
+  while (c != EOF && (isspace(c) || c == '#')) {
+    if (c == '#') {
+      while (c != EOF && c != '\n') {
+        c = fgetc(file);
+      }
+    }
+    c = fgetc(file);
+  }
+  if (c == EOF || !isdigit(c))
+    return false;
+
+  value = 0;
+  while (c != EOF && isdigit(c)) {
+    value = value * 10 + (c - '0');
+    c = fgetc(file);
+  }
+  return true;
+}
+
+// Reads a binary (P6) or ascii (P3) PPM with 8 bit channels
+bool loadPpm(const char* path, u32& width, u32& height, std::vector<u8>& rgb) {
+  FILE* file = fopen(path, "rb");
+  if (!file)
+    return false;
+
+  char magic[2];
+  u32 maxValue;
+  bool ok = fread(magic, 1, 2, file) == 2 && magic[0] == 'P' &&
+            (magic[1] == '3' || magic[1] == '6') &&
+            readPpmToken(file, width) && readPpmToken(file, height) &&
+            readPpmToken(file, maxValue) && maxValue == 255 && width > 0 &&
+            height > 0;
+
+  if (ok) {
+    rgb.resize(width * height * 3);
+    if (magic[1] == '6') {
+      ok = fread(rgb.data(), 1, rgb.size(), file) == rgb.size();
+    } else {
+      for (u32 i = 0; i < rgb.size() && ok; i++) {
+        u32 value;
+        ok = readPpmToken(file, value);
+        rgb[i] = u8(value);
+      }
+    }
+  }
+
+  fclose(file);
+  return ok;
+}
+
+void computeLevels(ImageFile* image) {
+  u64 offset = sizeof(u32) * 4;
+  u32 width = image->width;
+  u32 height = image->height;
+
+  image->levels.clear();
+  while (true) {
+    MipLevel level;
+    level.width = width;
+    level.height = height;
+    level.tilesX = (width + tileSize - 1) / tileSize;
+    level.tilesY = (height + tileSize - 1) / tileSize;
+    level.offset = offset;
+    image->levels.push_back(level);
+
+    offset += u64(level.tilesX) * level.tilesY * tileBytes;
+    if (width == 1 && height == 1)
+      break;
+    width = width > 1 ? width / 2 : 1;
+    height = height > 1 ? height / 2 : 1;
+  }
+}
+
+// 2x2 box filter down to the next level
+std::vector<u8> downsample(const std::vector<u8>& source,
+                           const MipLevel& from,
+                           const MipLevel& to) {
+  std::vector<u8> result(to.width * to.height * 3);
+  for (u32 y = 0; y < to.height; y++) {
+    for (u32 x = 0; x < to.width; x++) {
+      u32 x0 = std::min<u32>(2 * x, from.width - 1);
+      u32 x1 = std::min<u32>(2 * x + 1, from.width - 1);
+      u32 y0 = std::min<u32>(2 * y, from.height - 1);
+      u32 y1 = std::min<u32>(2 * y + 1, from.height - 1);
+      for (u32 c = 0; c < 3; c++) {
+        u32 sum = source[(y0 * from.width + x0) * 3 + c] +
+                  source[(y0 * from.width + x1) * 3 + c] +
+                  source[(y1 * from.width + x0) * 3 + c] +
+                  source[(y1 * from.width + x1) * 3 + c];
+        result[(y * to.width + x) * 3 + c] = u8((sum + 2) / 4);
+      }
+    }
+  }
+  return result;
+}
+
+// NOTE(johan): Converting needs the whole source image in memory once, this
+// is the offline step. Rendering only ever touches the tiles.
+bool writeMipFile(const char* sourcePath, const char* mipPath) {
+  ImageFile image;
+  std::vector<u8> pixels;
+  if (!loadPpm(sourcePath, image.width, image.height, pixels))
+    return false;
+
+  computeLevels(&image);
+
+  FILE* file = fopen(mipPath, "wb");
+  if (!file)
+    return false;
+
+  u32 header[4] = {0x50494d52, image.width, image.height,
+                   u32(image.levels.size())};
+  fwrite(header, sizeof(header), 1, file);
+
+  Tile tile;
+  for (u32 levelIndex = 0; levelIndex < image.levels.size(); levelIndex++) {
+    const MipLevel& level = image.levels[levelIndex];
+    if (levelIndex > 0) {
+      pixels = downsample(pixels, image.levels[levelIndex - 1], level);
+    }
+
+    // Edge tiles are padded by clamping so every tile is the same size
+    for (u32 tileY = 0; tileY < level.tilesY; tileY++) {
+      for (u32 tileX = 0; tileX < level.tilesX; tileX++) {
+        for (u32 y = 0; y < tileSize; y++) {
+          for (u32 x = 0; x < tileSize; x++) {
+            u32 sourceX = std::min<u32>(tileX * tileSize + x, level.width - 1);
+            u32 sourceY = std::min<u32>(tileY * tileSize + y, level.height - 1);
+            for (u32 c = 0; c < 3; c++) {
+              tile.texels[(y * tileSize + x) * 3 + c] =
+                  pixels[(sourceY * level.width + sourceX) * 3 + c];
+            }
+          }
+        }
+        fwrite(tile.texels, tileBytes, 1, file);
+      }
+    }
+  }
+
+  bool ok = !ferror(file);
+  fclose(file);
+  return ok;
+}
+
+// NOTE(johan): Compares to the nanosecond, whole seconds would miss an image
+// edited in the same second its mip file was written. A tie still counts as
+// stale: on file systems with coarser timestamps it costs a rebuild rather
+// than a stale texture, and a mip file just written is opened unchecked.
+bool isNewer(const struct stat& a, const struct stat& b) {
+  if (a.st_mtim.tv_sec != b.st_mtim.tv_sec)
+    return a.st_mtim.tv_sec > b.st_mtim.tv_sec;
+  return a.st_mtim.tv_nsec > b.st_mtim.tv_nsec;
+}
+
+// Fails if the mip file is missing, isn't one, or (unless it was just written)
+// isn't newer than the image it was made from
+bool openMipFile(ImageFile* image, const char* mipPath, bool justWritten) {
+  struct stat source, mips;
+  if (!justWritten && stat(image->path.c_str(), &source) == 0 &&
+      (stat(mipPath, &mips) != 0 || !isNewer(mips, source))) {
+    return false;
+  }
+
+  image->fd = open(mipPath, O_RDONLY);
+  if (image->fd < 0)
+    return false;
+
+  u32 header[4];
+  if (pread(image->fd, header, sizeof(header), 0) != sizeof(header) ||
+      header[0] != 0x50494d52) {
+    close(image->fd);
+    return false;
+  }
+
+  image->width = header[1];
+  image->height = header[2];
+  computeLevels(image);
+  if (image->levels.size() != header[3]) {
+    close(image->fd);
+    return false;
+  }
+  return true;
+}
+
+//
+// Tile cache
+//
+
+TextureCache* createTextureCache(u64 budgetBytes) {
+  TextureCache* cache = new TextureCache();
+  for (u32 i = 0; i < cacheShardCount; i++) {
+    cache->shards[i].residentBytes = 0;
+    cache->shards[i].budgetBytes =
+        std::max<u64>(budgetBytes / cacheShardCount, sizeof(Tile));
+  }
+  cache->imageCount = 0;
+  cache->hits = 0;
+  cache->misses = 0;
+  cache->evictions = 0;
+  return cache;
+}
+
+inline u64 tileKey(u32 image, u32 level, u32 tileX, u32 tileY) {
+  return (u64(image) << 48) | (u64(level) << 40) | (u64(tileY) << 20) | tileX;
+}
+
+inline CacheShard& getShard(TextureCache* cache, u64 key) {
+  u64 hash = key * 0x9e3779b97f4a7c15ull;
+  return cache->shards[(hash >> 32) % cacheShardCount];
+}
+
+// NOTE(johan): Tiles are handed out as shared pointers, so evicting a tile
+// from the cache never frees texels another thread is still filtering. The
+// file read happens outside the lock; if two threads miss on the same tile at
+// once they both read it and the second insert is dropped.
+std::shared_ptr<Tile> fetchTile(TextureCache* cache,
+                                u32 imageId,
+                                u32 levelIndex,
+                                u32 tileX,
+                                u32 tileY) {
+  u64 key = tileKey(imageId, levelIndex, tileX, tileY);
+  CacheShard& shard = getShard(cache, key);
+
+  {
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto found = shard.index.find(key);
+    if (found != shard.index.end()) {
+      shard.lru.splice(shard.lru.begin(), shard.lru, found->second);
+      cache->hits++;
+      return found->second->tile;
+    }
+  }
+
+  cache->misses++;
+
+  const ImageFile* image = cache->images[imageId];
+  const MipLevel& level = image->levels[levelIndex];
+  std::shared_ptr<Tile> tile = std::make_shared<Tile>();
+  u64 offset = level.offset + (u64(tileY) * level.tilesX + tileX) * tileBytes;
+  if (pread(image->fd, tile->texels, tileBytes, offset) != tileBytes) {
+    fatal("Failed to read texture tile");
+  }
+
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  auto found = shard.index.find(key);
+  if (found != shard.index.end()) {
+    return found->second->tile;
+  }
+
+  shard.lru.push_front({key, tile});
+  shard.index[key] = shard.lru.begin();
+  shard.residentBytes += sizeof(Tile);
+
+  while (shard.residentBytes > shard.budgetBytes && shard.lru.size() > 1) {
+    shard.index.erase(shard.lru.back().key);
+    shard.lru.pop_back();
+    shard.residentBytes -= sizeof(Tile);
+    cache->evictions++;
+  }
+
+  return tile;
+}
+
+// Looks up texels within one mip level, remembering the last tile fetched
+// since a bilinear footprint almost always falls inside a single tile
+struct TexelFetcher {
+  TextureCache* cache;
+  u32 imageId;
+  u32 level;
+  u32 tileX;
+  u32 tileY;
+  std::shared_ptr<Tile> tile;
+
+  vec3 fetch(u32 x, u32 y) {
+    u32 tx = x / tileSize;
+    u32 ty = y / tileSize;
+    if (!tile || tx != tileX || ty != tileY) {
+      tile = fetchTile(cache, imageId, level, tx, ty);
+      tileX = tx;
+      tileY = ty;
+    }
+    const u8* texel =
+        &tile->texels[((y % tileSize) * tileSize + (x % tileSize)) * 3];
+    return vec3(texel[0], texel[1], texel[2]) / 255.0f;
+  }
+};
+
+vec3 bilinear(TextureCache* cache, u32 imageId, u32 levelIndex, f32 u, f32 v) {
+  const MipLevel& level = cache->images[imageId]->levels[levelIndex];
+
+  // Repeat wrapping, v = 0 is the bottom row of the image
+  u -= floor(u);
+  v -= floor(v);
+  f32 x = u * level.width - 0.5f;
+  f32 y = (1 - v) * level.height - 0.5f;
+  f32 x0 = floor(x);
+  f32 y0 = floor(y);
+  f32 fx = x - x0;
+  f32 fy = y - y0;
+
+  auto wrap = [](s32 i, u32 size) {
+    return u32((i % s32(size) + size) % size);
+  };
+  u32 ix0 = wrap(s32(x0), level.width);
+  u32 ix1 = wrap(s32(x0) + 1, level.width);
+  u32 iy0 = wrap(s32(y0), level.height);
+  u32 iy1 = wrap(s32(y0) + 1, level.height);
+
+  TexelFetcher fetcher = {cache, imageId, levelIndex, 0, 0, nullptr};
+  return lerp(lerp(fetcher.fetch(ix0, iy0), fetcher.fetch(ix1, iy0), fx),
+              lerp(fetcher.fetch(ix0, iy1), fetcher.fetch(ix1, iy1), fx), fy);
+}
+
+// Trilinear lookup, footprint is the filter width in uv units
+vec3 sample(TextureCache* cache, u32 imageId, f32 u, f32 v, f32 footprint) {
+  const ImageFile* image = cache->images[imageId];
+  u32 lastLevel = image->levels.size() - 1;
+  u32 size = std::max(image->width, image->height);
+  f32 lod = log2(max(footprint * size, 1));
+  lod = min(lod, f32(lastLevel));
+
+  u32 level = u32(lod);
+  f32 t = lod - level;
+  vec3 result = bilinear(cache, imageId, level, u, v);
+  if (t > 0 && level < lastLevel) {
+    result = lerp(result, bilinear(cache, imageId, level + 1, u, v), t);
+  }
+  return result;
+}
+
+u32 addImage(TextureCache* cache, const char* path) {
+  std::string mipPath = std::string(path) + ".mip";
+
+  ImageFile* image = new ImageFile();
+  image->path = path;
+  if (!openMipFile(image, mipPath.c_str(), false)) {
+    if (!writeMipFile(path, mipPath.c_str()) ||
+        !openMipFile(image, mipPath.c_str(), true)) {
+      fatal("Failed to load image texture");
+    }
+  }
+
+  std::lock_guard<std::mutex> lock(cache->imagesMutex);
+  u32 imageId = cache->imageCount;
+  if (imageId == maxImages) {
+    fatal("Too many image textures");
+  }
+  cache->images[imageId] = image;
+  cache->imageCount = imageId + 1;
+  return imageId;
+}
+
+void printStats(const TextureCache* cache) {
+  u64 resident = 0;
+  for (u32 i = 0; i < cacheShardCount; i++) {
+    resident += cache->shards[i].residentBytes;
+  }
+  std::cerr << "Texture cache: " << cache->hits << " hits, " << cache->misses
+            << " misses, " << cache->evictions << " evictions, "
+            << resident / 1024 << " KB resident\n";
+}
+
+//
+// Evaluation
+//
+
+TextureCache* textureCache;
+
+vec3 value(const Texture* texture, const Hit& hit) {
+  switch (texture->type) {
+    case TextureType::Constant:
+      return texture->constant.color;
+
+    case TextureType::Checker: {
+      const Checker& checker = texture->checker;
+      f32 sines = sin(checker.frequency * hit.p.x) *
+                  sin(checker.frequency * hit.p.y) *
+                  sin(checker.frequency * hit.p.z);
+      return value(sines < 0 ? checker.odd : checker.even, hit);
+    }
+
+    case TextureType::Noise: {
+      const Noise& noise = texture->noise;
+      f32 phase = noise.scale * hit.p.z + 10 * turbulence(perlin, hit.p);
+      f32 marble = 0.5f * (1 + sin(phase));
+      return marble * noise.color;
+    }
+
+    case TextureType::Image:
+      return sample(textureCache, texture->image.id, hit.u, hit.v,
+                    hit.coneWidth * hit.uvScale);
+  }
+  return vec3(0, 0, 0);
+}
+
+Texture* createConstant(const vec3 color) {
+  Texture* texture = (Texture*)malloc(sizeof(Texture));
+  texture->type = TextureType::Constant;
+  texture->constant.color = color;
+  return texture;
+}
+
+Texture* createChecker(Texture* odd, Texture* even, const f32 frequency) {
+  Texture* texture = (Texture*)malloc(sizeof(Texture));
+  texture->type = TextureType::Checker;
+  texture->checker.odd = odd;
+  texture->checker.even = even;
+  texture->checker.frequency = frequency;
+  return texture;
+}
+
+Texture* createNoise(const vec3 color, const f32 scale) {
+  if (!perlin) {
+    perlin = createPerlin();
+  }
+  Texture* texture = (Texture*)malloc(sizeof(Texture));
+  texture->type = TextureType::Noise;
+  texture->noise.color = color;
+  texture->noise.scale = scale;
+  return texture;
+}
+
+Texture* createImage(const char* path) {
+  if (!textureCache) {
+    fatal("Texture cache must be created before image textures");
+  }
+  Texture* texture = (Texture*)malloc(sizeof(Texture));
+  texture->type = TextureType::Image;
+  texture->image.id = addImage(textureCache, path);
+  return texture;
+}
+
+}  // namespace texture
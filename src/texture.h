@@ -0,0 +1,106 @@
+#pragma once
+
+namespace texture {
+
+enum class TextureType { Constant, Checker, Noise, Image };
+
+struct Texture;
+
+struct Constant {
+  vec3 color;
+};
+
+// 3D checker pattern in world space, alternating between two other textures
+struct Checker {
+  Texture* odd;
+  Texture* even;
+  f32 frequency;
+};
+
+// Marble-like Perlin turbulence
+struct Noise {
+  vec3 color;
+  f32 scale;
+};
+
+// An image texture, served a tile at a time through the TextureCache
+struct Image {
+  u32 id;
+};
+
+struct Texture {
+  TextureType type;
+  union {
+    Constant constant;
+    Checker checker;
+    Noise noise;
+    Image image;
+  };
+};
+
+//
+// Texture cache
+//
+
+// NOTE(johan): Images are converted once into a tiled, mip-mapped file next
+// to the source (<path>.mip). At render time only the tiles that lookups
+// actually touch are read from that file, and the cache evicts the least
+// recently used tiles to keep resident texels under a budget. So a scene can
+// reference far more texture data than fits in memory.
+const u32 tileSize = 32;
+const u32 tileBytes = tileSize * tileSize * 3;
+
+struct Tile {
+  u8 texels[tileBytes];
+};
+
+struct MipLevel {
+  u32 width;
+  u32 height;
+  u32 tilesX;
+  u32 tilesY;
+  u64 offset;
+};
+
+struct ImageFile {
+  std::string path;
+  s32 fd;
+  u32 width;
+  u32 height;
+  std::vector<MipLevel> levels;
+};
+
+struct CachedTile {
+  u64 key;
+  std::shared_ptr<Tile> tile;
+};
+
+// NOTE(johan): The cache is split into shards, each with its own lock and LRU
+// list, so render threads looking up different tiles rarely contend.
+struct CacheShard {
+  std::mutex mutex;
+  std::list<CachedTile> lru;  // Most recently used at the front
+  std::unordered_map<u64, std::list<CachedTile>::iterator> index;
+  u64 residentBytes;
+  u64 budgetBytes;
+};
+
+const u32 cacheShardCount = 16;
+const u32 maxImages = 1024;
+
+// NOTE(johan): Images live in a fixed table rather than a vector so adding
+// one never moves the others while render threads are looking them up.
+// Adding takes imagesMutex and only publishes the new entry through
+// imageCount once it's filled in.
+struct TextureCache {
+  CacheShard shards[cacheShardCount];
+  std::mutex imagesMutex;
+  ImageFile* images[maxImages];
+  std::atomic<u32> imageCount;
+
+  std::atomic<u64> hits;
+  std::atomic<u64> misses;
+  std::atomic<u64> evictions;
+};
+
+}  // namespace texture
@@ -0,0 +1,132 @@
+namespace views {
+
+// NOTE(johan): Views rendered at once. Their rows are interleaved on the
+// pool, so while one view's pass is finishing its last few rows the threads
+// carry on with the other's instead of waiting. Any more than two and every
+// view would finish at the very end rather than one after another.
+const u32 viewsInFlight = 2;
+
+// Passes per view, like a single image
+const u32 passesPerView = 10;
+
+// count views evenly spaced around the look at point
+std::vector<View> turntable(u32 count) {
+  std::vector<View> views;
+  for (u32 i = 0; i < count; i++) {
+    View view = {{360.0f * i / count, 0, 1}, 0};
+    views.push_back(view);
+  }
+  return views;
+}
+
+// A left and right eye view, separation apart
+std::vector<View> stereo(f32 separation) {
+  View left = {{0, 0, 1}, 0.5f * separation};
+  View right = {{0, 0, 1}, -0.5f * separation};
+  return {left, right};
+}
+
+// Views from a spec of "turntable:count", "stereo:separation" or the path
+// of a file with one view per line, each a query string like
+// "yaw=30&pitch=10&dolly=1.5&slide=0.1". Blank lines and lines starting with
+// # are skipped. Returns no views if the spec is no good.
+std::vector<View> parseViews(const char* spec) {
+  if (!strncmp(spec, "turntable:", 10)) {
+    return turntable(std::max(atoi(spec + 10), 0));
+  }
+  if (!strncmp(spec, "stereo:", 7)) {
+    return stereo(atof(spec + 7));
+  }
+
+  std::vector<View> views;
+  std::ifstream file(spec);
+  std::string line;
+  while (std::getline(file, line)) {
+    if (line.empty() || line[0] == '#')
+      continue;
+    View view;
+    view.move.yaw = preview::queryValue(line, "yaw", 0);
+    view.move.pitch = preview::queryValue(line, "pitch", 0);
+    view.move.dolly = max(preview::queryValue(line, "dolly", 1), 0.01f);
+    view.slide = preview::queryValue(line, "slide", 0);
+    views.push_back(view);
+  }
+  return views;
+}
+
+camera::Camera* createCamera(const scenes::LoadedScene* scene,
+                             const View& view,
+                             const render::RenderSettings& settings) {
+  camera::Camera* resized =
+      camera::resize(scene->camera, settings.width, settings.height);
+  camera::Camera* orbited = camera::orbit(resized, view.move.yaw,
+                                          view.move.pitch, view.move.dolly);
+  camera::Camera* camera = camera::slide(orbited, view.slide);
+  free(resized);
+  free(orbited);
+  return camera;
+}
+
+// NOTE(johan): Renders every view of the one scene, sharing its acceleration
+// structure, on a single service thread pool. Each view is a job of its own,
+// driven a pass at a time by one of viewsInFlight threads, which then hands
+// it to viewDone and takes the next view. With guided set every view trains
+// a guide of its own.
+void render(const scenes::LoadedScene* scene,
+            const std::vector<View>& views,
+            const render::RenderSettings& settings,
+            const numa::Placement* placement,
+            bool guided,
+            const ViewDone& viewDone) {
+  service::ThreadPool* pool =
+      service::createThreadPool(settings.threadCount, placement);
+  std::atomic<u32> nextView(0);
+  std::mutex doneMutex;
+
+  auto renderViews = [&]() {
+    for (u32 index = nextView++; index < views.size(); index = nextView++) {
+      camera::Camera* camera = createCamera(scene, views[index], settings);
+      guide::Guide* guide =
+          guided ? guide::createGuide(scene->bounds, camera) : nullptr;
+
+      service::Job job;
+      job.renderRow =
+          scenes::createRowRenderer(scene, camera, settings.maxDepth, guide);
+      job.framebuffer =
+          render::createFramebuffer(settings.width, settings.height);
+      if (placement) {
+        render::placeRows(*job.framebuffer, placement);
+      }
+
+      u32 passSamples = std::max(settings.samples / passesPerView, 1u);
+      while (job.framebuffer->samples < settings.samples) {
+        u32 passSize =
+            std::min(passSamples, settings.samples - job.framebuffer->samples);
+        service::renderPass(pool, &job, passSize);
+        if (guide) {
+          guide::endPass(guide, job.framebuffer->samples, settings.samples);
+        }
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(doneMutex);
+        viewDone(index, *job.framebuffer);
+      }
+
+      delete job.framebuffer;
+      delete guide;
+      free(camera);
+    }
+  };
+
+  std::vector<std::thread> drivers;
+  for (u32 i = 0; i < std::min<u32>(viewsInFlight, views.size()); i++) {
+    drivers.push_back(std::thread(renderViews));
+  }
+  for (auto& driver : drivers) {
+    driver.join();
+  }
+  service::destroyThreadPool(pool);
+}
+
+}  // namespace views
@@ -0,0 +1,15 @@
+namespace views {
+
+// NOTE(johan): One viewpoint of a multi-view render, given as a move of the
+// scene's own camera: an orbit like the preview's, then a slide sideways
+// (towards the camera's left) for stereo pairs.
+struct View {
+  preview::CameraMove move;
+  f32 slide;
+};
+
+// Called with each view's finished framebuffer, one call at a time
+typedef std::function<void(u32 index, const render::Framebuffer& framebuffer)>
+    ViewDone;
+
+}  // namespace views